@@ -6,48 +6,458 @@
 #include <cstring>
 #include <vector>
 #include<iostream>
+#include <stdint.h>
+#include <time.h>
+#include <x86intrin.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
 #include "libGameLogic.h"
 
+// Game symbols the hook needs, resolved once when the library is loaded so
+// nothing on the per-frame path goes through dlsym.
+static struct {
+	ClientWorld** gameWorld;
+} game;
+
+// The world once the game has set it up, NULL before that.
+static ClientWorld* current_world() {
+	return game.gameWorld ? *game.gameWorld : NULL;
+}
+
+static uint64_t now_ns() {
+	timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
+
+// Hook timings are TSC ticks, which cost a few cycles to read where
+// clock_gettime costs tens of nanoseconds. They are converted to time only
+// when printed, at the rate measured since the library was loaded.
+static uint64_t ticks() {
+	return __rdtsc();
+}
+
+static struct {
+	uint64_t ticks;
+	uint64_t ns;
+} loaded;
+
+static double ticks_per_ns() {
+	uint64_t ns = now_ns() - loaded.ns;
+	return ns ? (double)(ticks() - loaded.ticks) / ns : 1;
+}
+
+// Log-linear histogram: every power of two is split into HIST_SUB equal
+// buckets, so any value is placed to within 1/HIST_SUB of itself whether it
+// is a hundred ticks or a billion. Updates are relaxed atomic adds, so no
+// hook ever waits on another thread or on someone reading it.
+#define HIST_SUB_BITS 4
+#define HIST_SUB (1 << HIST_SUB_BITS)
+#define HIST_BUCKETS ((64 - HIST_SUB_BITS + 1) * HIST_SUB)
+
+struct Histogram {
+	uint64_t max;
+	uint64_t buckets[HIST_BUCKETS];
+
+	static int bucket(uint64_t v) {
+		if (v < HIST_SUB)
+			return v;
+		int e = 63 - __builtin_clzll(v);
+		return ((e - HIST_SUB_BITS + 1) << HIST_SUB_BITS) | ((v >> (e - HIST_SUB_BITS)) & (HIST_SUB - 1));
+	}
+
+	// Largest value that lands in bucket b.
+	static uint64_t bucket_top(int b) {
+		if (b < HIST_SUB)
+			return b;
+		int shift = (b >> HIST_SUB_BITS) - 1;
+		return ((uint64_t)(HIST_SUB | (b & (HIST_SUB - 1))) << shift) + ((1ull << shift) - 1);
+	}
+
+	void record(uint64_t v) {
+		__atomic_fetch_add(&buckets[bucket(v)], 1, __ATOMIC_RELAXED);
+		uint64_t m = __atomic_load_n(&max, __ATOMIC_RELAXED);
+		while (v > m && !__atomic_compare_exchange_n(&max, &m, v, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			;
+	}
+
+	// Smallest bucket top that at least a fraction p of the values are at
+	// or under, out of total.
+	uint64_t percentile(double p, uint64_t total) {
+		uint64_t seen = 0;
+		for (int b = 0; b < HIST_BUCKETS; b++) {
+			seen += __atomic_load_n(&buckets[b], __ATOMIC_RELAXED);
+			if (seen && seen >= p * total) {
+				uint64_t top = bucket_top(b);
+				uint64_t m = __atomic_load_n(&max, __ATOMIC_RELAXED);
+				return top < m ? top : m;
+			}
+		}
+		return __atomic_load_n(&max, __ATOMIC_RELAXED);
+	}
+};
+
+// Output of the chat commands. Formatting floats and writing to stdout
+// would stall the game thread for as long as the terminal or disk takes, so
+// the game thread only copies the values into a ring of fixed-size records
+// and a background thread formats them and writes them out in batches, to
+// stdout or to the file named by HACK_LOG. Only the game thread logs, which
+// lets the ring get by with two counters and no locks. A full ring drops
+// lines, and later says how many, rather than wait. With nothing to write
+// the writer sleeps on a futex, and the game thread wakes it only when it
+// has said it is asleep.
+#define LOG_RECORDS 4096        // power of two
+#define LOG_LINE 256            // room to leave in the batch for one more line
+#define LOG_TEXT 32
+
+// A line's text goes in its record, copied since the actor it names may be
+// gone by the time it is printed. Text too long for one record goes first
+// in LOG_MORE records, which the writer prints as they are.
+enum { LOG_POS, LOG_ACTOR, LOG_HOOK, LOG_PERF, LOG_MORE };
+
+struct LogRecord {
+	int kind;
+	uint64_t calls;
+	double v[3];
+	char text[LOG_TEXT];
+};
+
+static struct {
+	LogRecord records[LOG_RECORDS];
+	alignas(64) uint64_t head;      // written by the game thread
+	uint64_t dropped;
+	alignas(64) uint64_t tail;      // written by the writer
+	int sleeping;
+	uint32_t wakeups;               // the futex the writer sleeps on
+	int fd;
+	bool started;
+	bool stop;
+	pthread_t writer;
+} logger;
+
+static void log_wake() {
+	__atomic_fetch_add(&logger.wakeups, 1, __ATOMIC_SEQ_CST);
+	syscall(SYS_futex, &logger.wakeups, FUTEX_WAKE_PRIVATE, 1, NULL, NULL, 0);
+}
+
+static void log_push(int kind, const char* text, uint64_t calls, double a, double b, double c) {
+	size_t len = strlen(text);
+	size_t more = len ? (len - 1) / (LOG_TEXT - 1) : 0;
+	uint64_t head = logger.head;
+	if (head + more + 1 - __atomic_load_n(&logger.tail, __ATOMIC_ACQUIRE) > LOG_RECORDS) {
+		__atomic_store_n(&logger.dropped, logger.dropped + 1, __ATOMIC_RELAXED);
+		return;
+	}
+	for (size_t i = 0; i <= more; i++) {
+		LogRecord* r = &logger.records[(head + i) & (LOG_RECORDS - 1)];
+		size_t n = len < LOG_TEXT - 1 ? len : LOG_TEXT - 1;
+		memcpy(r->text, text, n);
+		r->text[n] = 0;
+		text += n;
+		len -= n;
+		r->kind = i < more ? LOG_MORE : kind;
+	}
+	LogRecord* r = &logger.records[(head + more) & (LOG_RECORDS - 1)];
+	r->calls = calls;
+	r->v[0] = a;
+	r->v[1] = b;
+	r->v[2] = c;
+	// The whole line appears at once. Publishing and then checking for a
+	// sleeping writer, while it says it sleeps and then checks for records,
+	// means one of the two always sees the other.
+	__atomic_store_n(&logger.head, head + more + 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logger.sleeping, __ATOMIC_SEQ_CST))
+		log_wake();
+}
+
+// Sleeps until there is more than head to write, or the logger is stopped.
+static void log_sleep(uint64_t head) {
+	uint32_t seen = __atomic_load_n(&logger.wakeups, __ATOMIC_SEQ_CST);
+	__atomic_store_n(&logger.sleeping, 1, __ATOMIC_SEQ_CST);
+	if (__atomic_load_n(&logger.head, __ATOMIC_SEQ_CST) == head && !__atomic_load_n(&logger.stop, __ATOMIC_SEQ_CST))
+		syscall(SYS_futex, &logger.wakeups, FUTEX_WAIT_PRIVATE, seen, NULL, NULL, 0);
+	__atomic_store_n(&logger.sleeping, 0, __ATOMIC_SEQ_CST);
+}
+
+static size_t log_format(const LogRecord* r, char* out, size_t len) {
+	unsigned long long calls = r->calls;
+	int n = 0;
+	switch (r->kind) {
+	case LOG_POS:
+		n = snprintf(out, len, "x:%f, y:%f, z:%f", r->v[0], r->v[1], r->v[2]);
+		break;
+	case LOG_ACTOR:
+		n = snprintf(out, len, "%s: %g %g %g\n", r->text, r->v[0], r->v[1], r->v[2]);
+		break;
+	case LOG_HOOK:
+		n = snprintf(out, len, "%s: %llu calls, %.0f ns in handlers (%.0f ns per call)\n",
+			r->text, calls, r->v[0], r->v[1]);
+		break;
+	case LOG_PERF:
+		n = snprintf(out, len, "%s: %llu calls, p50 %.2f us, p99 %.2f us, max %.2f us\n",
+			r->text, calls, r->v[0], r->v[1], r->v[2]);
+		break;
+	case LOG_MORE:
+		n = snprintf(out, len, "%s", r->text);
+		break;
+	}
+	return n < 0 ? 0 : (size_t)n < len ? n : len - 1;
+}
+
+static void log_write(const char* buf, size_t len) {
+	while (len > 0) {
+		ssize_t n = write(logger.fd, buf, len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			return;
+		buf += n;
+		len -= n;
+	}
+}
+
+static void* log_writer(void*) {
+	static char batch[1 << 16];
+	uint64_t dropped = 0;
+	for (;;) {
+		// Everything logged before stop was set is below head.
+		bool stop = __atomic_load_n(&logger.stop, __ATOMIC_ACQUIRE);
+		uint64_t head = __atomic_load_n(&logger.head, __ATOMIC_ACQUIRE);
+		uint64_t tail = logger.tail;
+		bool idle = tail == head;
+		size_t len = 0;
+		for (; tail != head; tail++) {
+			if (sizeof(batch) - len < LOG_LINE) {
+				__atomic_store_n(&logger.tail, tail, __ATOMIC_RELEASE);
+				log_write(batch, len);
+				len = 0;
+			}
+			len += log_format(&logger.records[tail & (LOG_RECORDS - 1)], batch + len, sizeof(batch) - len);
+		}
+		__atomic_store_n(&logger.tail, tail, __ATOMIC_RELEASE);
+
+		uint64_t d = __atomic_load_n(&logger.dropped, __ATOMIC_RELAXED);
+		if (d != dropped) {
+			if (sizeof(batch) - len < LOG_LINE) {
+				log_write(batch, len);
+				len = 0;
+			}
+			len += snprintf(batch + len, sizeof(batch) - len, "hack: %llu log lines dropped\n",
+				(unsigned long long)(d - dropped));
+			dropped = d;
+		}
+		log_write(batch, len);
+
+		if (idle && stop)
+			return NULL;
+		if (idle)
+			log_sleep(head);
+	}
+}
+
+__attribute__((constructor)) static void start_logger() {
+	logger.fd = STDOUT_FILENO;
+	const char* path = getenv("HACK_LOG");
+	if (path) {
+		int fd = open(path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+		if (fd < 0)
+			fprintf(stderr, "hack: can't open %s, logging to stdout\n", path);
+		else
+			logger.fd = fd;
+	}
+	logger.started = pthread_create(&logger.writer, NULL, log_writer, NULL) == 0;
+	if (!logger.started)
+		fprintf(stderr, "hack: can't start the log writer\n");
+}
+
+// Lets the writer finish what is in the ring before the process goes.
+__attribute__((destructor)) static void stop_logger() {
+	if (!logger.started)
+		return;
+	__atomic_store_n(&logger.stop, true, __ATOMIC_SEQ_CST);
+	log_wake();
+	pthread_join(logger.writer, NULL);
+}
+
+// Hook chaining. Each function we interpose calls the game's original,
+// resolved with RTLD_NEXT, and runs our handlers around it. A pre-handler
+// returns false to keep the original from running; a post-handler gets a
+// pointer to the result (NULL for void functions) and may change it. Every
+// call is timestamped on entry and exit; the time spent in our handlers and
+// the latency of the whole call, original included, are kept per hook.
+#define MAX_HANDLERS 8
+
+struct HookStats {
+	const char* name;
+	uint64_t calls;
+	uint64_t overhead;      // ticks spent in handlers
+	Histogram latency;      // ticks from entry to exit
+
+	void record(uint64_t entry, uint64_t before, uint64_t after, uint64_t exit) {
+		__atomic_fetch_add(&calls, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&overhead, (before - entry) + (exit - after), __ATOMIC_RELAXED);
+		latency.record(exit - entry);
+	}
+};
+
+// Somewhere to keep the original's result, even when it has none.
+template <typename R> struct Result {
+	R value;
+	Result() : value() {}
+	template <typename F, typename... A> void call(F f, A... a) { value = f(a...); }
+	R* ptr() { return &value; }
+	R get() { return value; }
+};
+
+template <> struct Result<void> {
+	template <typename F, typename... A> void call(F f, A... a) { f(a...); }
+	void* ptr() { return NULL; }
+	void get() {}
+};
+
+// Plain data, so hooks are set up before any constructor runs.
+template <typename R, typename... Args> struct Hook {
+	HookStats stats;
+	R (*original)(Args...);
+	bool (*pre[MAX_HANDLERS])(Args...);
+	void (*post[MAX_HANDLERS])(R*, Args...);
+
+	R call(Args... args) {
+		uint64_t entry = ticks();
+		bool forward = true;
+		for (int i = 0; i < MAX_HANDLERS && pre[i]; i++)
+			forward = pre[i](args...) && forward;
+		uint64_t before = ticks();
+
+		Result<R> result;
+		if (forward && original)
+			result.call(original, args...);
+
+		uint64_t after = ticks();
+		for (int i = 0; i < MAX_HANDLERS && post[i]; i++)
+			post[i](result.ptr(), args...);
+		stats.record(entry, before, after, ticks());
+		return result.get();
+	}
+};
+
+static bool chat_command(Player* player, const char* msg);
+
+static void boost_player(void*, World*, float) {
+	ClientWorld* world = current_world();
+	if (world == NULL)
+		return;
+	IPlayer* iplayer = world->m_activePlayer.m_object;
+	Player* player = ((Player*)(iplayer));
+	player->m_walkingSpeed = 99999;
+	player->m_jumpSpeed = 999;
+	player->m_jumpHoldTime = 99999;
+}
+
+static void always_jump(bool* can_jump, Player*) {
+	*can_jump = true;
+}
+
+static Hook<void, World*, float> tick_hook = {{"World::Tick"}, NULL, {}, {boost_player}};
+static Hook<void, Player*, const char*> chat_hook = {{"Player::Chat"}, NULL, {chat_command}, {}};
+static Hook<bool, Player*> jump_hook = {{"Player::CanJump"}, NULL, {}, {always_jump}};
+
+static HookStats* hooks[] = {&tick_hook.stats, &chat_hook.stats, &jump_hook.stats};
+
+static const struct {
+	const char* name;
+	void** slot;
+} symbols[] = {
+	{"GameWorld", (void**)&game.gameWorld},
+	{"_ZN5World4TickEf", (void**)&tick_hook.original},
+	{"_ZN6Player4ChatEPKc", (void**)&chat_hook.original},
+	{"_ZN6Player7CanJumpEv", (void**)&jump_hook.original},
+};
+
+__attribute__((constructor)) static void resolve_symbols() {
+	loaded.ticks = ticks();
+	loaded.ns = now_ns();
+	timespec start, end;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	int missing = 0;
+	for (size_t i = 0; i < sizeof(symbols) / sizeof(symbols[0]); i++) {
+		*symbols[i].slot = dlsym(RTLD_NEXT, symbols[i].name);
+		if (*symbols[i].slot == NULL) {
+			fprintf(stderr, "hack: symbol %s not found\n", symbols[i].name);
+			missing++;
+		}
+	}
+	clock_gettime(CLOCK_MONOTONIC, &end);
+	long us = (end.tv_sec - start.tv_sec) * 1000000 + (end.tv_nsec - start.tv_nsec) / 1000;
+	fprintf(stderr, "hack: resolved %zu symbols (%d missing) in %ld us\n",
+		sizeof(symbols) / sizeof(symbols[0]) - missing, missing, us);
+}
+
 bool Player::CanJump() {
-	return 1;
+	return jump_hook.call(this);
 }
 
 void Player::Chat(const char* msg) {
+	chat_hook.call(this, msg);
+}
+
+void World::Tick(float f) {
+	tick_hook.call(this, f);
+}
+
+// Our commands. Returns false for the ones it handles, so they aren't sent
+// on as chat.
+static bool chat_command(Player* player, const char* msg) {
 	if(strncmp("tp ", msg, 3) == 0){
 		Vector3* new_pos = new Vector3();
 		sscanf(msg+3, "%f %f %f", &(new_pos->x), &(new_pos->y), &(new_pos->z));
-		this->SetPosition(*new_pos);
+		player->SetPosition(*new_pos);
 	} else if(strncmp("pos", msg, 3) == 0) {
-		Vector3 new_pos = this->GetPosition();
+		Vector3 new_pos = player->GetPosition();
 		float x_coor = new_pos.x;
 		float y_coor = new_pos.y;
 		float z_coor = new_pos.z;
-		printf("x:%f, y:%f, z:%f", x_coor, y_coor, z_coor);
-		fflush(stdout);
+		log_push(LOG_POS, "", 0, x_coor, y_coor, z_coor);
 	} else if(strncmp("tpz ", msg, 4) == 0){
-		Vector3 curr_pos = this->GetPosition();
+		Vector3 curr_pos = player->GetPosition();
 		Vector3* new_pos = new Vector3(curr_pos);
 		sscanf(msg+4, "%f", &(new_pos->z));
-		this->SetPosition(*new_pos);
+		player->SetPosition(*new_pos);
 	} else if(strncmp("actors", msg, 6) == 0){
-		ClientWorld* world = *(ClientWorld**)dlsym(RTLD_NEXT, "GameWorld");
+		ClientWorld* world = current_world();
+		if (world == NULL)
+			return false;
 		for (auto i = world->m_actors.begin(); i != world->m_actors.end(); ++i) {
 			ActorRef<IActor> iactor = *i;
 			Actor* actor = static_cast<Actor*>(iactor.m_object);
 			Vector3 pos = actor->GetPosition();
-			std::cout<< actor->GetDisplayName() << ": " << pos.x << " " << pos.y << " " << pos.z << std::endl;
+			log_push(LOG_ACTOR, actor->GetDisplayName(), 0, pos.x, pos.y, pos.z);
 		}
+	} else if(strncmp("hooks", msg, 5) == 0){
+		double rate = ticks_per_ns();
+		for (size_t i = 0; i < sizeof(hooks) / sizeof(hooks[0]); i++) {
+			HookStats* h = hooks[i];
+			uint64_t calls = __atomic_load_n(&h->calls, __ATOMIC_RELAXED);
+			double overhead = __atomic_load_n(&h->overhead, __ATOMIC_RELAXED) / rate;
+			log_push(LOG_HOOK, h->name, calls, overhead, calls ? overhead / calls : 0, 0);
+		}
+	} else if(strncmp("perf", msg, 4) == 0){
+		double us = ticks_per_ns() * 1000;
+		for (size_t i = 0; i < sizeof(hooks) / sizeof(hooks[0]); i++) {
+			HookStats* h = hooks[i];
+			uint64_t calls = __atomic_load_n(&h->calls, __ATOMIC_RELAXED);
+			log_push(LOG_PERF, h->name, calls, h->latency.percentile(0.5, calls) / us,
+				h->latency.percentile(0.99, calls) / us,
+				__atomic_load_n(&h->latency.max, __ATOMIC_RELAXED) / us);
+		}
+	} else {
+		return true;
 	}
-
-}
-
-void World::Tick(float f) {
-	ClientWorld* world = *(ClientWorld**)dlsym(RTLD_NEXT, "GameWorld");
-	IPlayer* iplayer = world->m_activePlayer.m_object;
-	Player* player = ((Player*)(iplayer));
-	player->m_walkingSpeed = 99999;
-	player->m_jumpSpeed = 999;
-	player->m_jumpHoldTime = 99999;
+	return false;
 }
 
 int main(){
@@ -0,0 +1,221 @@
+# Benchmarks brainfuck.c across build flags and engines.
+#
+# Every NAME.b in corpus/ is run with NAME.in (if present) on stdin and the
+# options listed in NAME.args (if present). Outputs are checked against
+# corpus/SHA256SUMS and against each other, and each run reports wall time,
+# instructions per second and peak RSS. The instruction count is the
+# interpreter's; the AOT engine runs what the C compiler made of the program,
+# and evaluates everything before the first ',' at compile time, so it is
+# reported by time alone.
+#
+# The usual public benchmarks (mandelbrot.b, hanoi.b, factor.b) are not
+# shipped, as nothing here records the terms they may be redistributed
+# under. They can be dropped into corpus/ as they are; without a stored
+# checksum they are only checked for agreement between engines.
+#
+#   python3 bench.py                          text report
+#   python3 bench.py --json out.json          also write the results as JSON
+#   python3 bench.py --save-baseline b.json   record timings to compare against
+#   python3 bench.py --baseline b.json        exit 1 if anything got slower
+
+import argparse
+import hashlib
+import json
+import os
+import re
+import shutil
+import subprocess
+import sys
+import tempfile
+import threading
+import time
+
+HERE = os.path.dirname(os.path.abspath(__file__))
+SOURCE = os.path.join(HERE, "..", "brainfuck.c")
+CORPUS = os.path.join(HERE, "corpus")
+
+BUILDS = {
+    "O2": ["-O2"],
+    "native": ["-O3", "-march=native"],
+}
+
+ENGINES = {
+    "interp": [],
+    "jit": ["-j"],
+    "aot": ["-c"],
+    "trace": ["--trace"],
+}
+
+
+def build(name, flags, out_dir):
+    cc = os.environ.get("CC", "cc")
+    binary = os.path.join(out_dir, "brainfuck-" + name)
+    subprocess.run([cc, *flags, "-o", binary, SOURCE], check=True)
+    return binary
+
+
+def load_corpus(only):
+    programs = []
+    for entry in sorted(os.listdir(CORPUS)):
+        if not entry.endswith(".b"):
+            continue
+        name = entry[:-2]
+        if only and name not in only:
+            continue
+        path = os.path.join(CORPUS, entry)
+        stdin = b""
+        args = []
+        if os.path.exists(os.path.join(CORPUS, name + ".in")):
+            with open(os.path.join(CORPUS, name + ".in"), "rb") as f:
+                stdin = f.read()
+        if os.path.exists(os.path.join(CORPUS, name + ".args")):
+            with open(os.path.join(CORPUS, name + ".args")) as f:
+                args = f.read().split()
+        programs.append({"name": name, "path": path, "stdin": stdin, "args": args})
+    return programs
+
+
+def load_checksums():
+    sums = {}
+    path = os.path.join(CORPUS, "SHA256SUMS")
+    if os.path.exists(path):
+        with open(path) as f:
+            for line in f:
+                digest, name = line.split()
+                sums[name[:-2]] = digest
+    return sums
+
+
+# Peak RSS of a running process, in KiB. wait4's ru_maxrss can't be used:
+# it includes the forked harness's own footprint from before the exec.
+def watch_rss(pid, binary, peak, stop):
+    while not stop.wait(0.002):
+        try:
+            if os.readlink("/proc/%d/exe" % pid) != binary:
+                continue
+            with open("/proc/%d/status" % pid) as f:
+                for line in f:
+                    if line.startswith("VmHWM:"):
+                        peak[0] = max(peak[0], int(line.split()[1]))
+        except (OSError, ValueError):
+            pass
+
+
+# Runs cmd once and returns (stdout, stderr, seconds, peak RSS in KiB).
+def run_once(cmd, stdin, env, timeout):
+    with tempfile.TemporaryFile() as inp, tempfile.TemporaryFile() as out, tempfile.TemporaryFile() as err:
+        inp.write(stdin)
+        inp.seek(0)
+        peak, stop = [0], threading.Event()
+        start = time.perf_counter()
+        proc = subprocess.Popen(cmd, stdin=inp, stdout=out, stderr=err, env=env)
+        watcher = threading.Thread(target=watch_rss, args=(proc.pid, os.path.realpath(cmd[0]), peak, stop))
+        watcher.start()
+        timer = threading.Timer(timeout, proc.kill)
+        timer.start()
+        try:
+            _, status, _ = os.wait4(proc.pid, 0)
+        finally:
+            timer.cancel()
+            stop.set()
+            watcher.join()
+        elapsed = time.perf_counter() - start
+        proc.returncode = os.waitstatus_to_exitcode(status)
+        if elapsed >= timeout:
+            raise RuntimeError("%s timed out after %.0fs" % (" ".join(cmd), timeout))
+        if proc.returncode != 0:
+            err.seek(0)
+            raise RuntimeError("%s exited with %d: %s" % (" ".join(cmd), proc.returncode, err.read().decode(errors="replace")))
+        out.seek(0)
+        err.seek(0)
+        return out.read(), err.read(), elapsed, peak[0] or None
+
+
+# Executed (optimized) instruction count, taken from a --profile run.
+def count_instructions(binary, prog, env, timeout):
+    _, err, _, _ = run_once([binary, "--profile", *prog["args"], "-f", prog["path"]], prog["stdin"], env, timeout)
+    m = re.search(rb"profile: (\d+) instructions", err)
+    return int(m.group(1)) if m else None
+
+
+def main():
+    ap = argparse.ArgumentParser(description="Benchmark brainfuck.c over the corpus.")
+    ap.add_argument("programs", nargs="*", help="corpus programs to run (default: all)")
+    ap.add_argument("--builds", default=",".join(BUILDS), help="comma-separated build configurations")
+    ap.add_argument("--engines", default=",".join(ENGINES), help="comma-separated engines")
+    ap.add_argument("--repeat", type=int, default=3, help="runs per measurement; the fastest counts")
+    ap.add_argument("--timeout", type=float, default=120, help="seconds before a run counts as failed")
+    ap.add_argument("--json", metavar="FILE", help="write the results as JSON")
+    ap.add_argument("--baseline", metavar="FILE", help="compare against a saved baseline")
+    ap.add_argument("--save-baseline", metavar="FILE", help="save these results as the baseline")
+    ap.add_argument("--threshold", type=float, default=0.10, help="slowdown that counts as a regression")
+    opts = ap.parse_args()
+
+    programs = load_corpus(set(opts.programs))
+    checksums = load_checksums()
+    work = tempfile.mkdtemp(prefix="bfbench-")
+    env = dict(os.environ, BF_CACHE_DIR=os.path.join(work, "cache"))
+    results = []
+    failed = False
+
+    try:
+        binaries = {b: build(b, BUILDS[b], work) for b in opts.builds.split(",")}
+        counts = {p["name"]: count_instructions(binaries[next(iter(binaries))], p, env, opts.timeout) for p in programs}
+
+        print("%-10s %-8s %-7s %10s %12s %10s  %s" % ("program", "build", "engine", "time (s)", "Minstr/s", "RSS (KiB)", "output"))
+        for prog in programs:
+            digests = set()
+            for build_name, binary in binaries.items():
+                for engine in opts.engines.split(","):
+                    cmd = [binary, *ENGINES[engine], *prog["args"], "-f", prog["path"]]
+                    # One untimed run first, which also fills the AOT cache.
+                    out, _, _, _ = run_once(cmd, prog["stdin"], env, opts.timeout)
+                    best, rss = None, 0
+                    for _ in range(opts.repeat):
+                        out, _, elapsed, peak = run_once(cmd, prog["stdin"], env, opts.timeout)
+                        best = elapsed if best is None else min(best, elapsed)
+                        rss = max(rss, peak or 0)
+
+                    digest = hashlib.sha256(out).hexdigest()
+                    digests.add(digest)
+                    expected = checksums.get(prog["name"])
+                    status = "ok" if digest == expected else "unverified" if expected is None else "WRONG"
+                    failed |= status == "WRONG"
+                    n = counts[prog["name"]] if engine != "aot" else None
+                    rate = n / best / 1e6 if n else None
+                    results.append({
+                        "program": prog["name"], "build": build_name, "engine": engine,
+                        "seconds": best, "instructions": n, "mips": rate, "max_rss_kib": rss or None,
+                        "sha256": digest, "status": status,
+                    })
+                    print("%-10s %-8s %-7s %10.4f %12s %10s  %s" % (
+                        prog["name"], build_name, engine, best,
+                        "%.1f" % rate if rate else "-", rss or "-", status))
+            if len(digests) > 1:
+                print("%s: engines disagree on the output" % prog["name"])
+                failed = True
+    finally:
+        shutil.rmtree(work, ignore_errors=True)
+
+    if opts.json:
+        with open(opts.json, "w") as f:
+            json.dump({"results": results}, f, indent=2)
+    if opts.save_baseline:
+        with open(opts.save_baseline, "w") as f:
+            json.dump({r["program"] + "/" + r["build"] + "/" + r["engine"]: r["seconds"] for r in results}, f, indent=2)
+
+    if opts.baseline:
+        with open(opts.baseline) as f:
+            baseline = json.load(f)
+        for r in results:
+            key = r["program"] + "/" + r["build"] + "/" + r["engine"]
+            if key in baseline and r["seconds"] > baseline[key] * (1 + opts.threshold):
+                print("REGRESSION %s: %.4fs -> %.4fs (+%.0f%%)" % (
+                    key, baseline[key], r["seconds"], 100 * (r["seconds"] / baseline[key] - 1)))
+                failed = True
+
+    sys.exit(1 if failed else 0)
+
+
+if __name__ == "__main__":
+    main()
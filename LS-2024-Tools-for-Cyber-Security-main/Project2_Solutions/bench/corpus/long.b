@@ -0,0 +1,27 @@
+long: deeply nested counting loops that print a single byte
+
+>+>+>+>+>++<[>[<+++>-
+
+ >>>>>
+ >+>+>+>+>++<[>[<+++>-
+
+   >>>>>
+   >+>+>+>+>++<[>[<+++>-
+
+     >>>>>
+     >+>+>+>+>++<[>[<+++>-
+
+       >>>>>
+       +++[->+++++<]>[-]<
+       <<<<<
+
+     ]<<]>[-]
+     <<<<<
+
+   ]<<]>[-]
+   <<<<<
+
+ ]<<]>[-]
+ <<<<<
+
+]<<]>.
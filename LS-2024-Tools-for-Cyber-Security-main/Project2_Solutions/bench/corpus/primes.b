@@ -0,0 +1,24 @@
+primes: prints the primes below 256 by trial division
+as many times over as the digit on input says
+
+,------------------------------------------------[>>[-]++<[-]+++++++++++++++
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++
++++++++++++[>>>>[-]+<<[-]++<[->>+>>+<<<<]>>>>[-<<<<+>>>>]<<--[>>>>>>[-]>[-]>
+[-]>[-]>[-]>[-]<<<<<<<<<<<<<[->>>>>>>>+<<<<+<<<<]>>>>[-<<<<+>>>>]<<<[->>>>>>
+>>+<<<<<+<<<]>>>[-<<<+>>>]>>>>[->-[>+>>]>[+[-<+>]>+>>]<<<<<]<<<<[-]+>>>>>>[[
+-]<<<<<<[-]>>>>>>]<<<<<<[<[-]>[-]]<<<+>-]>[>>>>>>>>>>>>>>>[-]>[-]>[-]>[-]>[-
+]>[-]>[-]>[-]>[-]>[-]>[-]>[-]<<<<<<<<<<<<<<<<<<<<<<<<<<<<<[->>>>>>>>>>>>>>>>
+>>+<<<<<<<<<<<<<<+<<<<]>>>>[-<<<<+>>>>]>>>>>>>>>>>>>>>++++++++++<[->-[>+>>]>
+[+[-<+>]>+>>]<<<<<]>[-]>[->>>>>>>>+<<<<<<<<]>[->+<]>>++++++++++<[->-[>+>>]>[
++[-<+>]>+>>]<<<<<]>[-]>>[->>>>+<<<<<<<<<<<<<<<<<<<<<<<<<+>>>>>>>>>>>>>>>>>>>
+>>]<<<<<<<<<<<<<<<<<<<<<[->>>>>>>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<<<<<<]>>>>>>
+>>>>>>>>>>>>>>>[++++++++++++++++++++++++++++++++++++++++++++++++.[-]]<[->>>>
+>+<<<<<<<<<<<<<<<<<<<<<<<<<+>>>>>>>>>>>>>>>>>>>>]<<<<<<<<<<<<<<<<<<<<[->>>>>
+>>>>>>>>>>>>>>>+<<<<<<<<<<<<<<<<<<<<][-]>>>>>>>>>>>>>>>>>>>>[-<<<<<<<<<<<<<<
+<<<<<<+>>>>>>>>>>>>>>>>>>>>]>>>>>[<<<<<<<<<<<<<<<<<<<<<<<<<[->>>>>>>>>>>>>>>
+>>>>>+<<<<<<<<<<<<<<<<<<<+<]>[-<+>]>>>>>>>>>>>>>>>>>>>++++++++++++++++++++++
+++++++++++++++++++++++++++.[-]>>>>>[-]]<<<<<<<<<<<<<<<<<<<<<<<<<[-]>>>>>>>>>
+>>>>>>>>>>>>>>>++++++++++++++++++++++++++++++++++++++++++++++++.[-]<++++++++
+++.[-]<<<<<<<<<<<<<<<<<<<<<<<<[-]]<<<+<-]<-]
@@ -0,0 +1,3 @@
+printer: writes the printable ASCII range on each of 131072 lines
+
+>>>>>++++++++++<<<<<++++++++++++++++++++++++++++++++[>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[>++++++++++++++++++++++++++++++++>+++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++++[<.+>-]<[-]>>.<<<-]<-]<-]
@@ -1,66 +1,3353 @@
 #include <stdio.h>
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <dirent.h>
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+#include <time.h>
 
-#define MEMORY_SIZE 30000
+#include "brainfuck.h"
 
-void run(char* code) {
-    char memory[MEMORY_SIZE] = {0};
-    char* ptr = memory;
+#if defined(__SSE2__)
+#include <immintrin.h>
+#endif
 
-    char* ip = code;
+#define DEFAULT_TAPE_SIZE 30000
+#define TAPE_RESERVE ((size_t)1 << 31)
+#define TAPE_REACH ((int64_t)1 << 24)   // cells a single instruction may reach from the pointer
+#define TAPE_GUARD ((size_t)TAPE_REACH * 4)
+#define TAPE_GROW_MIN ((size_t)1 << 16)
+#define MAX_TAPES 4096
+#define IO_BUFFER_SIZE 65536
+#define BUDGET_SLICE 16384      // back-edges between clock reads under a deadline
 
-    while (*ip) {
-        // fprintf(stdout, "Executing %c\n", *ip);
-        // printf("%s\n", memory);
-        switch (*ip) {
+// Cell operands are addressed as ptr[off]: the compiler tracks pointer
+// movement within a straight-line block and only materializes it as an
+// OP_MOVE at loop edges.
+enum {
+    OP_ADD,     // ptr[off] += arg
+    OP_MOVE,    // ptr += arg
+    OP_OUT,     // output ptr[off]
+    OP_IN,      // input ptr[off]
+    OP_JZ,      // if (*ptr == 0) goto arg
+    OP_JNZ,     // if (*ptr != 0) goto arg
+    OP_CLEAR,   // ptr[off] = 0
+    OP_MUL,     // ptr[off] += ptr[src] * arg
+    OP_SCAN,    // while (*ptr) ptr += arg
+    OP_COUNT,   // counters[arg]++ (only in --profile builds)
+    OP_TRAP,    // debugger stop, patched over another op (see Traps)
+    OP_END
+};
+
+typedef struct {
+    int op;
+    int arg;
+    int off;
+    int src;
+} Instr;
+
+typedef struct {
+    Instr* code;    // terminated by OP_END
+    size_t len;     // not counting OP_END
+    int* pos;       // offset in the command text each instruction came from
+    int mapped;     // code and pos live in a bytecode file mapping
+} Program;
+
+// Cells are unsigned integers of 1, 2 or 4 bytes that either wrap around or
+// saturate at 0 and their maximum.
+typedef struct {
+    int width;
+    int saturate;
+} CellType;
+
+// v + n as the cell type would compute it.
+static uint32_t cell_add(const CellType* cells, uint32_t v, int64_t n) {
+    uint32_t max = cells->width == 4 ? 0xffffffffu : (1u << (8 * cells->width)) - 1;
+    int64_t r = (int64_t)v + n;
+    if (cells->saturate) return r < 0 ? 0 : r > max ? max : (uint32_t)r;
+    return (uint32_t)r & max;
+}
+
+typedef struct {
+    int off;
+    int delta;
+    int signs;  // bit 0: some add was positive, bit 1: some add was negative
+} CellDelta;
+
+// Rewrites the loop body prog[head + 1 .. len - 1] in place when it is a
+// balanced run of adds and moves whose control cell steps by exactly one,
+// e.g. [-], [->+<] or [->++>+++<<]. Every other touched cell then gains a
+// fixed multiple of the control cell, which is cleared at the end. Loops that
+// only move, like [>] or [<<], become a single scan. Returns the new program
+// length, or 0 if the loop doesn't match.
+//
+// A folded loop no longer needs the pointer on its control cell, so the move
+// emitted just before it is absorbed into the operand offsets and handed
+// back through *pending.
+//
+// Saturating cells only fold when the result doesn't depend on where the
+// clamping happens: the control cell must count down, and every other cell
+// must only ever move in one direction.
+static size_t fold_loop(Instr* prog, int* pos, size_t head, size_t len, int* pending, int saturate) {
+    if (len == head + 2 && prog[head + 1].op == OP_MOVE && prog[head + 1].arg != 0) {
+        prog[head] = (Instr){OP_SCAN, prog[head + 1].arg, 0};
+        return head + 1;
+    }
+
+    CellDelta* cells = malloc((len - head) * sizeof(CellDelta));
+    size_t ncells = 0;
+    int off = 0, step = 0, step_signs = 0, mixed = 0;
+
+    for (size_t i = head + 1; i < len; i++) {
+        if (prog[i].op == OP_MOVE) {
+            off += prog[i].arg;
+        } else if (prog[i].op != OP_ADD) {
+            free(cells);
+            return 0;
+        } else if (off + prog[i].off == 0) {
+            step += prog[i].arg;
+            step_signs |= prog[i].arg > 0 ? 1 : 2;
+        } else {
+            size_t k = 0;
+            while (k < ncells && cells[k].off != off + prog[i].off) k++;
+            if (k == ncells) cells[ncells++] = (CellDelta){off + prog[i].off, 0, 0};
+            cells[k].delta += prog[i].arg;
+            cells[k].signs |= prog[i].arg > 0 ? 1 : 2;
+            if (cells[k].signs == 3) mixed = 1;
+        }
+    }
+    if (off != 0 || (step != 1 && step != -1) || (saturate && (step_signs != 2 || mixed))) {
+        free(cells);
+        return 0;
+    }
+
+    int base = 0;
+    int at = pos[head];
+    if (head > 0 && prog[head - 1].op == OP_MOVE) {
+        head--;
+        base = prog[head].arg;
+    }
+
+    // A loop that counts the control cell up runs (-value) times instead of
+    // value times, so the factors flip sign.
+    len = head;
+    for (size_t k = 0; k < ncells; k++) {
+        if (cells[k].delta != 0) {
+            prog[len++] = (Instr){OP_MUL, cells[k].delta * -step, base + cells[k].off, base};
+        }
+    }
+    prog[len++] = (Instr){OP_CLEAR, 0, base};
+    for (size_t k = head; k < len; k++) pos[k] = at;
+    free(cells);
+    *pending = base;
+    return len;
+}
+
+// Dataflow pass over the compiled program. Cell values are tracked relative
+// to the pointer within a window around it, starting from the fact that the
+// whole tape is zero. With that it drops loops over a cell known to be zero
+// (including a leading comment loop and every loop that directly follows
+// another), clears of cells already zero, scans that start on a zero cell and
+// multiplies by a zero source, and turns multiplies by a known source into
+// plain adds. A second pass removes stores that a later clear overwrites
+// before anything reads the cell.
+#define DF_WINDOW 256           // offsets -DF_WINDOW .. DF_WINDOW-1 are tracked
+#define DF_LOOKBACK 64          // instructions searched for a dead store
+
+typedef struct {
+    unsigned char known[2 * DF_WINDOW];
+    uint32_t value[2 * DF_WINDOW];
+    int rest_zero;              // every cell outside the window is zero
+} Facts;
+
+static int facts_get(const Facts* f, int off, uint32_t* v) {
+    if (off < -DF_WINDOW || off >= DF_WINDOW) {
+        *v = 0;
+        return f->rest_zero;
+    }
+    *v = f->value[off + DF_WINDOW];
+    return f->known[off + DF_WINDOW];
+}
+
+static void facts_set(Facts* f, int off, int known, uint32_t v) {
+    if (off < -DF_WINDOW || off >= DF_WINDOW) {
+        if (!known || v) f->rest_zero = 0;
+        return;
+    }
+    f->known[off + DF_WINDOW] = (unsigned char)known;
+    f->value[off + DF_WINDOW] = v;
+}
+
+static void facts_unknown(Facts* f) {
+    memset(f->known, 0, sizeof(f->known));
+    f->rest_zero = 0;
+}
+
+static void facts_move(Facts* f, int n) {
+    Facts old = *f;
+    for (int i = 0; i < 2 * DF_WINDOW; i++) {
+        int from = i + n;   // the cell at new offset i was at old offset i + n
+        if (from >= 0 && from < 2 * DF_WINDOW) {
+            f->known[i] = old.known[from];
+            f->value[i] = old.value[from];
+        } else {
+            f->known[i] = (unsigned char)old.rest_zero;
+            f->value[i] = 0;
+        }
+        // Cells leaving the window are only remembered through rest_zero.
+        int gone = i - n;
+        if (gone < 0 || gone >= 2 * DF_WINDOW) {
+            if (!old.known[i] || old.value[i]) f->rest_zero = 0;
+        }
+    }
+}
+
+// What holds after either of two paths: facts they agree on.
+static void facts_join(Facts* f, const Facts* other) {
+    for (int i = 0; i < 2 * DF_WINDOW; i++) {
+        if (!other->known[i] || other->value[i] != f->value[i]) f->known[i] = 0;
+    }
+    f->rest_zero &= other->rest_zero;
+}
+
+// A loop is balanced when every pass through its body leaves the pointer
+// where it started, so facts about cells the body never writes survive it.
+static unsigned char* balanced_loops(const Program* prog) {
+    unsigned char* balanced = calloc(prog->len + 1, 1);
+    size_t* stack = malloc((prog->len + 1) * sizeof(size_t));
+    int64_t* entry = malloc((prog->len + 1) * sizeof(int64_t));
+    size_t depth = 0;
+    int64_t moved = 0;
+    for (size_t i = 0; i < prog->len; i++) {
+        const Instr* in = &prog->code[i];
+        if (in->op == OP_JZ) {
+            stack[depth] = i;
+            entry[depth++] = moved;
+            balanced[i] = 1;
+        } else if (in->op == OP_MOVE) {
+            moved += in->arg;
+        } else if (in->op == OP_SCAN) {
+            for (size_t d = 0; d < depth; d++) balanced[stack[d]] = 0;
+        } else if (in->op == OP_JNZ) {
+            size_t head = stack[--depth];
+            if (moved != entry[depth]) balanced[head] = 0;
+            if (!balanced[head] && depth) balanced[stack[depth - 1]] = 0;
+        }
+    }
+    free(stack);
+    free(entry);
+    return balanced;
+}
+
+static void forget_writes(const Program* prog, size_t head, Facts* f) {
+    int moved = 0;
+    for (size_t i = head + 1; i < (size_t)prog->code[head].arg - 1; i++) {
+        const Instr* in = &prog->code[i];
+        if (in->op == OP_MOVE) moved += in->arg;
+        else if (in->op == OP_ADD || in->op == OP_CLEAR || in->op == OP_MUL || in->op == OP_IN) facts_set(f, in->off + moved, 0, 0);
+    }
+}
+
+static void analyze(Program* prog, const CellType* cells) {
+    size_t n = prog->len;
+    Instr* code = prog->code;
+    unsigned char* dead = calloc(n + 1, 1);
+    unsigned char* balanced = balanced_loops(prog);
+    Facts* saved = NULL;        // facts on entry to each open loop
+    size_t depth = 0, cap = 0;
+    Facts f;
+    memset(f.known, 1, sizeof(f.known));
+    memset(f.value, 0, sizeof(f.value));
+    f.rest_zero = 1;
+
+    for (size_t i = 0; i < n; i++) {
+        Instr* in = &code[i];
+        uint32_t v, src;
+        int known = facts_get(&f, in->off, &v);
+        switch (in->op) {
+            case OP_ADD:
+                if (known) facts_set(&f, in->off, 1, cell_add(cells, v, in->arg));
+                break;
+            case OP_CLEAR:
+                if (known && v == 0) dead[i] = 1;
+                facts_set(&f, in->off, 1, 0);
+                break;
+            case OP_MUL:
+                if (!facts_get(&f, in->src, &src)) {
+                    facts_set(&f, in->off, 0, 0);
+                } else if (src == 0) {
+                    dead[i] = 1;
+                } else {
+                    int64_t k = (int64_t)src * in->arg;
+                    if (!cells->saturate) k = (int32_t)(uint32_t)k;     // wraps the same either way
+                    if (k >= INT32_MIN && k <= INT32_MAX) *in = (Instr){OP_ADD, (int)k, in->off};
+                    facts_set(&f, in->off, known, cell_add(cells, v, k));
+                }
+                break;
+            case OP_IN:
+                facts_set(&f, in->off, 0, 0);
+                break;
+            case OP_MOVE:
+                facts_move(&f, in->arg);
+                break;
+            case OP_SCAN:
+                if (known && v == 0) {
+                    dead[i] = 1;
+                    break;
+                }
+                facts_unknown(&f);
+                facts_set(&f, 0, 1, 0);
+                break;
+            case OP_JZ:
+                if (known && v == 0) {
+                    size_t end = in->arg;
+                    memset(dead + i, 1, end - i);
+                    i = end - 1;
+                    break;
+                }
+                if (depth == cap) saved = realloc(saved, (cap = cap ? cap * 2 : 16) * sizeof(Facts));
+                saved[depth++] = f;
+                if (balanced[i]) forget_writes(prog, i, &f);
+                else facts_unknown(&f);
+                break;
+            case OP_JNZ:
+                // The loop exits either here or straight from its head.
+                depth--;
+                if (balanced[in->arg - 1]) facts_join(&f, &saved[depth]);
+                else facts_unknown(&f);
+                facts_set(&f, 0, 1, 0);
+                break;
+        }
+    }
+    free(saved);
+    free(balanced);
+
+    // Stores overwritten by a later clear in the same block, with no read of
+    // the cell in between.
+    for (size_t i = 0; i < n; i++) {
+        if (dead[i] || code[i].op != OP_CLEAR) continue;
+        int off = code[i].off;
+        for (size_t j = i, seen = 0; j-- > 0 && seen < DF_LOOKBACK;) {
+            if (dead[j]) continue;
+            seen++;
+            const Instr* in = &code[j];
+            if (in->op == OP_JZ || in->op == OP_JNZ || in->op == OP_MOVE || in->op == OP_SCAN) break;
+            if ((in->op == OP_OUT || in->op == OP_IN) && in->off == off) break;
+            if (in->op == OP_MUL && in->src == off) break;
+            if ((in->op == OP_ADD || in->op == OP_CLEAR || in->op == OP_MUL) && in->off == off) dead[j] = 1;
+        }
+    }
+
+    // Compact, relinking the loops that are left.
+    size_t len = 0, open = 0;
+    size_t* stack = malloc((n + 1) * sizeof(size_t));
+    for (size_t i = 0; i <= n; i++) {
+        if (dead[i]) continue;
+        code[len] = code[i];
+        prog->pos[len] = prog->pos[i];
+        if (code[len].op == OP_JZ) {
+            stack[open++] = len;
+        } else if (code[len].op == OP_JNZ) {
+            size_t head = stack[--open];
+            code[len].arg = head + 1;
+            code[head].arg = len + 1;
+        }
+        len++;
+    }
+    prog->len = len - 1;
+    free(stack);
+    free(dead);
+}
+
+// Whether every cell the instruction touches, and any pointer move it makes,
+// is within TAPE_REACH of the pointer, so the tape's guard catches it.
+static int instr_in_reach(const Instr* in) {
+    int64_t reach = in->op == OP_MOVE || in->op == OP_SCAN ? in->arg : 0;
+    return in->off >= -TAPE_REACH && in->off <= TAPE_REACH && in->src >= -TAPE_REACH &&
+           in->src <= TAPE_REACH && reach >= -TAPE_REACH && reach <= TAPE_REACH;
+}
+
+// Turns the source into an instruction array: comments are dropped, runs of
+// +- are folded into one add per cell, pointer moves are folded into operand
+// offsets, and every bracket gets the index of the instruction just past its
+// partner so loops never rescan the source. Returns -1 with a message in
+// error if the brackets don't match or the pointer moves further in one go
+// than the tape's guard covers.
+//
+// Without optimize every + and - keeps an add of its own and loops are
+// neither folded nor analyzed, so each cell changes where and when the
+// source changes it. Only pointer moves are still folded into offsets.
+static int compile(Program* out, const char* code, size_t code_len, const CellType* cells, int optimize,
+                   char* error, size_t error_len) {
+    size_t cap = 64, len = 0;
+    Instr* prog = malloc(cap * sizeof(Instr));
+    int* pos = malloc(cap * sizeof(int));
+    size_t* stack = malloc(cap * sizeof(size_t));
+    size_t depth = 0;
+    int pending = 0;    // pointer movement not yet emitted
+
+#define EMIT(...) (pos[len] = (int)(c - code), prog[len++] = (Instr){__VA_ARGS__})
+
+    for (const char* c = code; c < code + code_len; c++) {
+        if (len + 2 >= cap) {
+            cap *= 2;
+            prog = realloc(prog, cap * sizeof(Instr));
+            pos = realloc(pos, cap * sizeof(int));
+            stack = realloc(stack, cap * sizeof(size_t));
+        }
+        switch (*c) {
+            case '+':
+            case '-': {
+                // Merge into an earlier add to the same cell when only adds
+                // to other cells sit in between. With saturating cells +-
+                // isn't a no-op at the limits, so only same-sign runs merge.
+                int delta = *c == '+' ? 1 : -1;
+                size_t k = len;
+                while (k > 0 && prog[k - 1].op == OP_ADD && prog[k - 1].off != pending) k--;
+                if (optimize && k > 0 && prog[k - 1].op == OP_ADD &&
+                    !(cells->saturate && (prog[k - 1].arg > 0) != (delta > 0))) {
+                    prog[k - 1].arg += delta;
+                } else {
+                    EMIT(OP_ADD, delta, pending);
+                }
+                break;
+            }
             case '>':
-                ptr++;
+                pending++;
+                break;
+            case '<':
+                pending--;
+                break;
+            case '.':
+                EMIT(OP_OUT, 0, pending);
+                break;
+            case ',':
+                EMIT(OP_IN, 0, pending);
+                break;
+            case '[':
+                if (pending) EMIT(OP_MOVE, pending, 0);
+                pending = 0;
+                stack[depth++] = len;
+                EMIT(OP_JZ, 0, 0);
+                break;
+            case ']': {
+                if (depth == 0) {
+                    snprintf(error, error_len, "Unmatched ']' at command %ld", (long)(c - code));
+                    goto fail;
+                }
+                if (pending) EMIT(OP_MOVE, pending, 0);
+                pending = 0;
+                size_t head = stack[--depth];
+                size_t folded = optimize ? fold_loop(prog, pos, head, len, &pending, cells->saturate) : 0;
+                if (folded) {
+                    len = folded;
+                } else {
+                    EMIT(OP_JNZ, head + 1, 0);
+                    prog[head].arg = len;
+                }
+                break;
+            }
+        }
+    }
+#undef EMIT
+    if (depth != 0) {
+        snprintf(error, error_len, "Unmatched '[' at command %ld", (long)pos[stack[depth - 1]]);
+        goto fail;
+    }
+    for (size_t i = 0; i < len; i++) {
+        if (!instr_in_reach(&prog[i])) {
+            snprintf(error, error_len, "Pointer moves too far at command %ld", (long)pos[i]);
+            goto fail;
+        }
+    }
+    prog[len] = (Instr){OP_END, 0, 0};
+    pos[len] = (int)code_len;
+
+    free(stack);
+    out->code = prog;
+    out->len = len;
+    out->pos = pos;
+    out->mapped = 0;
+    if (optimize) analyze(out, cells);
+    return 0;
+
+fail:
+    free(stack);
+    free(prog);
+    free(pos);
+    return -1;
+}
+
+static void program_free(Program* prog) {
+    if (prog->mapped) return;
+    free(prog->code);
+    free(prog->pos);
+}
+
+// Zero-cell search for OP_SCAN; stride is in cells of the given width.
+// Blocks are loaded aligned so a load never straddles into a page the tape
+// doesn't own, then the equality mask is filtered down to the first byte of
+// each cell the stride actually visits.
+#define SCAN_FALLBACK(p, stride, width) \
+    switch (width) { \
+        case 1: while (*(uint8_t*)p) p += stride; break; \
+        case 2: while (*(uint16_t*)p) p += 2 * stride; break; \
+        default: while (*(uint32_t*)p) p += 4 * stride; break; \
+    }
+
+#if defined(__SSE2__)
+
+// Bit i of scan_pattern[s][r] is set when i % s == r.
+static unsigned short scan_pattern[17][16];
+static int scan_has_avx2;
+
+__attribute__((constructor))
+static void scan_init(void) {
+    for (int s = 1; s <= 16; s++) {
+        for (int i = 0; i < 16; i++) scan_pattern[s][i % s] |= 1u << i;
+    }
+    __builtin_cpu_init();
+    scan_has_avx2 = __builtin_cpu_supports("avx2");
+}
+
+static inline unsigned zero_mask_sse2(const char* b, int width) {
+    __m128i v = _mm_load_si128((const __m128i*)b);
+    __m128i z = _mm_setzero_si128();
+    __m128i eq = width == 1 ? _mm_cmpeq_epi8(v, z) : width == 2 ? _mm_cmpeq_epi16(v, z) : _mm_cmpeq_epi32(v, z);
+    return (unsigned)_mm_movemask_epi8(eq);
+}
+
+__attribute__((target("avx2")))
+static inline unsigned zero_mask_avx2(const char* b, int width) {
+    __m256i v = _mm256_load_si256((const __m256i*)b);
+    __m256i z = _mm256_setzero_si256();
+    __m256i eq = width == 1 ? _mm256_cmpeq_epi8(v, z) : width == 2 ? _mm256_cmpeq_epi16(v, z) : _mm256_cmpeq_epi32(v, z);
+    return (unsigned)_mm256_movemask_epi8(eq);
+}
+
+// First byte of every cell in a 32-byte block.
+static const unsigned cell_starts[5] = { 0, 0xffffffffu, 0x55555555u, 0, 0x11111111u };
+
+__attribute__((target("avx2")))
+static char* scan_fwd_avx2(char* p, int width) {
+    char* b = (char*)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned live = (~0u << (p - b)) & cell_starts[width];
+    for (;;) {
+        unsigned m = zero_mask_avx2(b, width) & live;
+        if (m) return b + __builtin_ctz(m);
+        b += 32;
+        live = cell_starts[width];
+    }
+}
+
+__attribute__((target("avx2")))
+static char* scan_back_avx2(char* p, int width) {
+    char* b = (char*)((uintptr_t)p & ~(uintptr_t)31);
+    unsigned live = (~0u >> (31 - (p - b))) & cell_starts[width];
+    for (;;) {
+        unsigned m = zero_mask_avx2(b, width) & live;
+        if (m) return b + 31 - __builtin_clz(m);
+        b -= 32;
+        live = cell_starts[width];
+    }
+}
+
+// s is the stride in bytes. r tracks which lane residue (mod s) the visited
+// cells fall on in the current 16-byte block; it shifts by 16 % s from one
+// block to the next.
+static char* scan_fwd_sse2(char* p, int s, int width) {
+    char* b = (char*)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned r = (unsigned)(p - b) % s;
+    unsigned live = 0xffffu << (p - b);
+    for (;;) {
+        unsigned m = zero_mask_sse2(b, width) & scan_pattern[s][r] & live;
+        if (m) return b + __builtin_ctz(m);
+        b += 16;
+        r = (r + s - 16 % s) % s;
+        live = 0xffffu;
+    }
+}
+
+static char* scan_back_sse2(char* p, int s, int width) {
+    char* b = (char*)((uintptr_t)p & ~(uintptr_t)15);
+    unsigned r = (unsigned)(p - b) % s;
+    unsigned live = 0xffffu >> (15 - (p - b));
+    for (;;) {
+        unsigned m = zero_mask_sse2(b, width) & scan_pattern[s][r] & live;
+        if (m) return b + 31 - __builtin_clz(m);
+        b -= 16;
+        r = (r + 16) % s;
+        live = 0xffffu;
+    }
+}
+
+static char* scan(char* p, int stride, int width) {
+    int bytes = stride * width;
+    if (stride == 1 && scan_has_avx2) return scan_fwd_avx2(p, width);
+    if (stride == -1 && scan_has_avx2) return scan_back_avx2(p, width);
+    if (bytes > 0 && bytes <= 16) return scan_fwd_sse2(p, bytes, width);
+    if (bytes < 0 && bytes >= -16) return scan_back_sse2(p, -bytes, width);
+    SCAN_FALLBACK(p, stride, width);
+    return p;
+}
+
+#else
+
+static char* scan(char* p, int stride, int width) {
+    SCAN_FALLBACK(p, stride, width);
+    return p;
+}
+
+#endif
+
+// Buffered I/O. Output collects in a buffer that goes out with a single
+// write() according to the flush policy; input is pulled in with read() a
+// buffer at a time. Embedders can swap either file descriptor for a callback.
+enum {
+    FLUSH_NEWLINE,  // after every '\n', before input and at exit
+    FLUSH_INPUT,    // before blocking for input and at exit
+    FLUSH_EXIT,     // only when the buffer fills up and at exit
+    FLUSH_NEVER,    // buffer grows without bound and is written at exit
+};
+
+// What ',' stores once input is exhausted.
+enum {
+    EOF_KEEP = BF_EOF_KEEP,
+    EOF_ZERO = BF_EOF_ZERO,
+    EOF_MINUS_ONE = BF_EOF_MINUS_ONE,
+};
+
+typedef struct {
+    unsigned char* out;
+    size_t out_len;
+    size_t out_cap;
+    int out_fd;
+    bf_write_fn write;      // replaces out_fd when set
+    void* write_ctx;
+    int flush;
+
+    unsigned char* in;
+    size_t in_pos;
+    size_t in_len;
+    int in_fd;
+    bf_read_fn read;        // replaces in_fd when set
+    void* read_ctx;
+    int eof;
+    int at_eof;
+} IO;
+
+static void io_init(IO* io, int flush, int eof) {
+    io->out_cap = IO_BUFFER_SIZE;
+    io->out = malloc(io->out_cap);
+    io->out_len = 0;
+    io->out_fd = STDOUT_FILENO;
+    io->write = NULL;
+    io->flush = flush;
+
+    io->in = malloc(IO_BUFFER_SIZE);
+    io->in_pos = 0;
+    io->in_len = 0;
+    io->in_fd = STDIN_FILENO;
+    io->read = NULL;
+    io->eof = eof;
+    io->at_eof = 0;
+}
+
+static void write_all(int fd, const unsigned char* data, size_t len) {
+    size_t done = 0;
+    while (done < len) {
+        ssize_t n = write(fd, data + done, len - done);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            break;
+        }
+        done += n;
+    }
+}
+
+static void io_flush(IO* io) {
+    if (io->write) {
+        if (io->out_len) io->write(io->write_ctx, io->out, io->out_len);
+    } else {
+        write_all(io->out_fd, io->out, io->out_len);
+    }
+    io->out_len = 0;
+}
+
+static void io_free(IO* io) {
+    io_flush(io);
+    free(io->out);
+    free(io->in);
+}
+
+static void io_overflow(IO* io) {
+    if (io->flush == FLUSH_NEVER) {
+        io->out_cap *= 2;
+        io->out = realloc(io->out, io->out_cap);
+    } else {
+        io_flush(io);
+    }
+}
+
+// Cells wider than a byte are written as their low byte.
+static inline void io_put(IO* io, int value) {
+    unsigned char c = (unsigned char)value;
+    if (io->out_len == io->out_cap) io_overflow(io);
+    io->out[io->out_len++] = c;
+    if (c == '\n' && io->flush == FLUSH_NEWLINE) io_flush(io);
+}
+
+static void io_fill(IO* io) {
+    if (io->flush <= FLUSH_INPUT) io_flush(io);
+    io->in_pos = 0;
+    io->in_len = 0;
+    while (!io->at_eof) {
+        ssize_t n = io->read ? (ssize_t)io->read(io->read_ctx, io->in, IO_BUFFER_SIZE)
+                             : read(io->in_fd, io->in, IO_BUFFER_SIZE);
+        if (n > 0) {
+            io->in_len = n;
+            return;
+        }
+        if (n < 0 && errno == EINTR) continue;
+        io->at_eof = 1;
+    }
+}
+
+// Returns the new value of a cell that currently holds `current`.
+static inline int io_get(IO* io, int current) {
+    if (io->in_pos == io->in_len) io_fill(io);
+    if (io->in_pos < io->in_len) return io->in[io->in_pos++];
+    if (io->eof == EOF_ZERO) return 0;
+    if (io->eof == EOF_MINUS_ONE) return -1;
+    return current;
+}
+
+// The tape is carved out of a large PROT_NONE reservation with cell 0 in the
+// middle. Only a window around the origin is readable and writable; touching
+// the guard pages beyond it raises SIGSEGV, and the handler commits more of
+// the reservation in that direction and lets the instruction retry. The
+// engines therefore never bounds-check, and a program may walk left of cell 0.
+// The first and last TAPE_GUARD bytes of the reservation are never
+// committed, and no instruction reaches further than that from the pointer,
+// so running off either end is reported instead of growing forever or
+// touching memory beyond the reservation.
+typedef struct {
+    char* base;     // reserved [base, base + reserved)
+    size_t reserved;
+    char* lo;       // committed [lo, hi)
+    char* hi;
+    char* origin;   // cell 0
+} Tape;
+
+// Tapes the SIGSEGV handler may grow. Slots are claimed with atomics so
+// tapes can come and go while other threads fault.
+static Tape* volatile live_tapes[MAX_TAPES];
+static size_t page_size;
+
+static int tape_grow(Tape* t, char* addr) {
+    char* limit_lo = t->base + TAPE_GUARD;
+    char* limit_hi = t->base + t->reserved - TAPE_GUARD;
+    if (addr < limit_lo || addr >= limit_hi) return -1;
+
+    size_t step = (size_t)(t->hi - t->lo);
+    if (step < TAPE_GROW_MIN) step = TAPE_GROW_MIN;
+    if (addr >= t->hi) {
+        char* hi = t->hi + step;
+        char* need = (char*)(((uintptr_t)addr + page_size) & ~(uintptr_t)(page_size - 1));
+        if (hi < need) hi = need;
+        if (hi > limit_hi) hi = limit_hi;
+        if (mprotect(t->hi, hi - t->hi, PROT_READ | PROT_WRITE) != 0) return -1;
+        t->hi = hi;
+    } else {
+        char* lo = t->lo - step;
+        char* need = (char*)((uintptr_t)addr & ~(uintptr_t)(page_size - 1));
+        if (lo > need) lo = need;
+        if (lo < limit_lo) lo = limit_lo;
+        if (mprotect(lo, t->lo - lo, PROT_READ | PROT_WRITE) != 0) return -1;
+        t->lo = lo;
+    }
+    return 0;
+}
+
+// Whatever handled SIGSEGV before tape_fault, for the faults that aren't ours.
+static struct sigaction host_segv;
+
+static void tape_fault(int sig, siginfo_t* info, void* uctx) {
+    char* addr = info->si_addr;
+    for (int i = 0; i < MAX_TAPES; i++) {
+        Tape* t = live_tapes[i];
+        if (t && addr >= t->base && addr < t->base + t->reserved) {
+            if (tape_grow(t, addr) == 0) return;
+            static const char msg[] = "Tape overflow\n";
+            // Nothing to be done if this fails; we are exiting either way.
+            if (write(STDERR_FILENO, msg, sizeof(msg) - 1) < 0) {}
+            _exit(1);
+        }
+    }
+    // Not ours: pass it on to the host's handler, or, if there is none, let
+    // the default action take the fault again. Ignoring a fault would only
+    // repeat it, so SIG_IGN gets the default action too.
+    if (host_segv.sa_flags & SA_SIGINFO) {
+        host_segv.sa_sigaction(sig, info, uctx);
+    } else if (host_segv.sa_handler != SIG_DFL && host_segv.sa_handler != SIG_IGN) {
+        host_segv.sa_handler(sig);
+    } else {
+        signal(sig, SIG_DFL);
+    }
+}
+
+// Run once for the whole process. Every tape_init waits for it to finish,
+// so no thread maps a tape before the handler is in and page_size is set.
+static void tape_setup(void) {
+    page_size = sysconf(_SC_PAGESIZE);
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_sigaction = tape_fault;
+    sa.sa_flags = SA_SIGINFO | SA_NODEFER;
+    sigemptyset(&sa.sa_mask);
+    sigaction(SIGSEGV, &sa, &host_segv);
+}
+
+static int tape_init(Tape* t, size_t cells) {
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, tape_setup);
+
+    t->reserved = TAPE_RESERVE;
+    t->base = mmap(NULL, t->reserved, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (t->base == MAP_FAILED) return -1;
+    t->origin = t->base + t->reserved / 2;
+    t->lo = t->origin;
+    t->hi = t->origin + ((cells + page_size - 1) & ~(page_size - 1));
+    if (t->hi > t->base + t->reserved - TAPE_GUARD) t->hi = t->base + t->reserved - TAPE_GUARD;
+    if (mprotect(t->lo, t->hi - t->lo, PROT_READ | PROT_WRITE) != 0) {
+        munmap(t->base, t->reserved);
+        return -1;
+    }
+
+    for (int i = 0; i < MAX_TAPES; i++) {
+        Tape* expected = NULL;
+        if (__atomic_compare_exchange_n(&live_tapes[i], &expected, t, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            return 0;
+        }
+    }
+    munmap(t->base, t->reserved);
+    return -1;
+}
+
+static void tape_free(Tape* t) {
+    for (int i = 0; i < MAX_TAPES; i++) {
+        if (live_tapes[i] == t) __atomic_store_n(&live_tapes[i], NULL, __ATOMIC_RELEASE);
+    }
+    munmap(t->base, t->reserved);
+}
+
+// Debugger support. A breakpoint is an OP_TRAP patched over the op of one
+// instruction, with the original op kept aside, so the engines run every
+// other instruction exactly as they would without a debugger. A watchpoint
+// is a trap after each instruction that may write the watched cell. A trap
+// asks trap_hit() whether to stop; if not, the engine carries on with the
+// original op.
+enum {
+    TRAP_BREAK = 1,
+    TRAP_WATCH = 2,
+    TRAP_STEP = 4,      // temporary, for single-stepping
+};
+
+#define MAX_WATCHES 16
+
+typedef struct {
+    unsigned char* op;      // original op of each trapped instruction
+    unsigned char* kind;    // TRAP_* bits, 0 when the instruction is untouched
+    size_t pass;            // trap to run through once when resuming on it
+    int width;
+    int watches;
+    int64_t watch[MAX_WATCHES];         // cell index
+    char* watch_at[MAX_WATCHES];
+    uint32_t watch_value[MAX_WATCHES];  // as of the last check
+    int hit;                // TRAP_* bit that caused the last stop
+    int hit_watch;          // for TRAP_WATCH: which one, and its old value
+    uint32_t hit_old;
+} Traps;
+
+static uint32_t cell_load(const char* p, int width) {
+    if (width == 1) return *(const uint8_t*)p;
+    if (width == 2) return *(const uint16_t*)p;
+    return *(const uint32_t*)p;
+}
+
+// Returns OP_TRAP to stop before instruction i, or the op to run there.
+static int trap_hit(Traps* t, size_t i) {
+    int hit = 0;
+    if (t->kind[i] & TRAP_WATCH) {
+        for (int w = 0; w < t->watches; w++) {
+            uint32_t v = cell_load(t->watch_at[w], t->width);
+            if (v == t->watch_value[w]) continue;
+            if (!hit) {
+                hit = TRAP_WATCH;
+                t->hit_watch = w;
+                t->hit_old = t->watch_value[w];
+            }
+            t->watch_value[w] = v;
+        }
+    }
+    if (!hit && i != t->pass) hit = t->kind[i] & (TRAP_BREAK | TRAP_STEP);
+    t->pass = SIZE_MAX;
+    if (!hit) return t->op[i];
+    t->hit = hit;
+    return OP_TRAP;
+}
+
+// Per-run state handed to an engine. ptr is updated to the final cell when
+// the engine returns. The budgeted engines also take budget and deadline,
+// and when either runs out, or a trap stops the run, they set paused and
+// leave in start the instruction to carry on from.
+typedef struct {
+    char* ptr;
+    IO* io;
+    uint64_t* counters;     // targets of OP_COUNT
+    size_t start;           // instruction to begin at
+    uint64_t budget;        // taken loop back-edges left
+    uint64_t deadline;      // CLOCK_MONOTONIC nanoseconds, 0 for none
+    int paused;
+    Traps* traps;           // only read by OP_TRAP
+    void** threaded;        // handler table kept between slices by a budgeted engine
+} Exec;
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+// Moves the next share of the budget over to a budgeted engine, or returns
+// 0 when it is used up or the deadline has passed. With a deadline the
+// shares are small enough that the clock is read every BUDGET_SLICE loop
+// iterations.
+static uint64_t budget_next(Exec* ex) {
+    if (ex->budget == 0 || (ex->deadline && now_ns() >= ex->deadline)) return 0;
+    uint64_t n = ex->deadline && ex->budget > BUDGET_SLICE ? BUDGET_SLICE : ex->budget;
+    ex->budget -= n;
+    return n;
+}
+
+// Out-of-line I/O for generated code (JIT and AOT), which can't inline
+// io_put/io_get.
+typedef void (*out_fn)(IO* io, int value);
+typedef int (*in_fn)(IO* io, int current);
+
+static void io_out_cb(IO* io, int value) {
+    io_put(io, value);
+}
+
+static int io_in_cb(IO* io, int current) {
+    return io_get(io, current);
+}
+
+// With GCC the interpreter is direct-threaded: every instruction gets the
+// address of its handler up front and each handler jumps straight to the
+// next one with a computed goto, so there is no central switch to mispredict.
+// Other compilers get the same handlers as a plain switch loop.
+#if defined(__GNUC__)
+#define THREADED 1
+#define CASE(op, label) label:
+#define DISPATCH() goto *code[ip - prog]
+#else
+#define THREADED 0
+#define CASE(op, label) case op:
+#define DISPATCH() continue
+#endif
+// No do/while wrapper: in the switch build DISPATCH() is a continue, which
+// has to reach the outer loop.
+#define NEXT() { ip++; DISPATCH(); }
+#define SKIP(n) { ip += (n); DISPATCH(); }
+
+// One fully specialized engine per cell type, so the cell width and overflow
+// policy cost nothing per instruction; run() picks one up front. Each has a
+// budgeted twin for resumable runs, so only those pay for the check.
+typedef void (*engine_fn)(const Instr* prog, Exec* ex);
+
+#define ENGINE execute_u8_wrap
+#define CELL uint8_t
+#define CELL_MAX UINT8_MAX
+#define SATURATE 0
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u16_wrap
+#define CELL uint16_t
+#define CELL_MAX UINT16_MAX
+#define SATURATE 0
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u32_wrap
+#define CELL uint32_t
+#define CELL_MAX UINT32_MAX
+#define SATURATE 0
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u8_sat
+#define CELL uint8_t
+#define CELL_MAX UINT8_MAX
+#define SATURATE 1
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u16_sat
+#define CELL uint16_t
+#define CELL_MAX UINT16_MAX
+#define SATURATE 1
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u32_sat
+#define CELL uint32_t
+#define CELL_MAX UINT32_MAX
+#define SATURATE 1
+#define BUDGET 0
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u8_wrap_budget
+#define CELL uint8_t
+#define CELL_MAX UINT8_MAX
+#define SATURATE 0
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u16_wrap_budget
+#define CELL uint16_t
+#define CELL_MAX UINT16_MAX
+#define SATURATE 0
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u32_wrap_budget
+#define CELL uint32_t
+#define CELL_MAX UINT32_MAX
+#define SATURATE 0
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u8_sat_budget
+#define CELL uint8_t
+#define CELL_MAX UINT8_MAX
+#define SATURATE 1
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u16_sat_budget
+#define CELL uint16_t
+#define CELL_MAX UINT16_MAX
+#define SATURATE 1
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+#define ENGINE execute_u32_sat_budget
+#define CELL uint32_t
+#define CELL_MAX UINT32_MAX
+#define SATURATE 1
+#define BUDGET 1
+#include "brainfuck_engine.h"
+
+static engine_fn select_engine(const CellType* cells, int budgeted) {
+    static const engine_fn engines[2][2][3] = {
+        {
+            { execute_u8_wrap, execute_u16_wrap, execute_u32_wrap },
+            { execute_u8_sat, execute_u16_sat, execute_u32_sat },
+        },
+        {
+            { execute_u8_wrap_budget, execute_u16_wrap_budget, execute_u32_wrap_budget },
+            { execute_u8_sat_budget, execute_u16_sat_budget, execute_u32_sat_budget },
+        },
+    };
+    return engines[budgeted != 0][cells->saturate != 0][cells->width == 1 ? 0 : cells->width == 2 ? 1 : 2];
+}
+
+#if defined(__x86_64__)
+
+// Native code generator. The tape pointer lives in rbx, the output/input
+// callbacks in r12/r13 and their IO context in r14, all callee-saved so the
+// callbacks can't clobber them. Cells are addressed as [rbx + disp32] with
+// the operand size picked from the cell width.
+typedef void (*jit_fn)(char* tape, IO* io, out_fn out, in_fn in);
+
+typedef struct {
+    unsigned char* code;
+    size_t len;
+    size_t cap;
+} Jit;
+
+static void emit(Jit* j, const void* bytes, size_t n) {
+    memcpy(j->code + j->len, bytes, n);
+    j->len += n;
+}
+
+static void emit_u8(Jit* j, unsigned char b) {
+    j->code[j->len++] = b;
+}
+
+static void emit_u32(Jit* j, unsigned int v) {
+    emit(j, &v, 4);
+}
+
+static void patch_rel32(Jit* j, size_t at, size_t target) {
+    unsigned int rel = (unsigned int)(target - (at + 4));
+    memcpy(j->code + at, &rel, 4);
+}
+
+// op8/op are the byte-sized and word/dword forms of an instruction whose
+// memory operand is the cell ptr[off]; reg fills the ModRM reg field.
+static void emit_cell_op(Jit* j, int width, unsigned char op8, unsigned char op, int reg, int off) {
+    if (width == 2) emit_u8(j, 0x66);
+    emit_u8(j, width == 1 ? op8 : op);
+    emit_u8(j, 0x83 | reg << 3);
+    emit_u32(j, off * width);
+}
+
+static void emit_imm(Jit* j, int width, unsigned int v) {
+    emit(j, &v, width);
+}
+
+// Zero-extending load of ptr[off] into eax/ecx/edx/ebx/esp/ebp/esi/edi.
+static void emit_load(Jit* j, int width, int reg, int off) {
+    if (width == 1) { emit_u8(j, 0x0f); emit_u8(j, 0xb6); }
+    else if (width == 2) { emit_u8(j, 0x0f); emit_u8(j, 0xb7); }
+    else emit_u8(j, 0x8b);
+    emit_u8(j, 0x83 | reg << 3);
+    emit_u32(j, off * width);
+}
+
+static void emit_store(Jit* j, int width, int reg, int off) {
+    emit_cell_op(j, width, 0x88, 0x89, reg, off);
+}
+
+static void emit_set(Jit* j, int width, int off, unsigned int v) {
+    emit_cell_op(j, width, 0xc6, 0xc7, 0, off);
+    emit_imm(j, width, v);
+}
+
+static void emit_call(Jit* j, const void* fn) {
+    uint64_t target = (uint64_t)(uintptr_t)fn;
+    emit_u8(j, 0x48); emit_u8(j, 0xb8); emit(j, &target, 8);   // mov rax, imm64
+    emit_u8(j, 0xff); emit_u8(j, 0xd0);                         // call rax
+}
+
+// Saturating add of a constant: add or sub, and on carry/borrow overwrite
+// the cell with the limit it ran into.
+static void emit_add_sat(Jit* j, int width, int off, int n, unsigned int max) {
+    if (n == 0) return;
+    unsigned int mag = n > 0 ? (unsigned int)n : 0u - (unsigned int)n;
+    if (mag > max) {
+        emit_set(j, width, off, n > 0 ? max : 0);
+        return;
+    }
+    emit_cell_op(j, width, 0x80, 0x81, n > 0 ? 0 : 5, off);    // add/sub [cell], imm
+    emit_imm(j, width, mag);
+    emit_u8(j, 0x73);                                           // jnc over the clamp
+    size_t at = j->len;
+    emit_u8(j, 0);
+    emit_set(j, width, off, n > 0 ? max : 0);
+    j->code[at] = (unsigned char)(j->len - at - 1);
+}
+
+// Five pushes on top of the return address keep rsp 16-byte aligned for the
+// callbacks.
+static const unsigned char jit_prologue[] = {
+    0x53,                   // push rbx
+    0x41, 0x54,             // push r12
+    0x41, 0x55,             // push r13
+    0x41, 0x56,             // push r14
+    0x41, 0x57,             // push r15
+    0x48, 0x89, 0xfb,       // mov rbx, rdi
+    0x49, 0x89, 0xf6,       // mov r14, rsi
+    0x49, 0x89, 0xd4,       // mov r12, rdx
+    0x49, 0x89, 0xcd,       // mov r13, rcx
+};
+static const unsigned char jit_epilogue[] = {
+    0x41, 0x5f,             // pop r15
+    0x41, 0x5e,             // pop r14
+    0x41, 0x5d,             // pop r13
+    0x41, 0x5c,             // pop r12
+    0x5b,                   // pop rbx
+    0xc3,                   // ret
+};
+
+// Code for one instruction other than a jump.
+static void emit_instr(Jit* j, const Instr* ip, const CellType* cells, uint64_t* counters) {
+    static const unsigned char mov_rdi_r14[] = { 0x4c, 0x89, 0xf7 };
+    static const unsigned char mov_rdi_rbx[] = { 0x48, 0x89, 0xdf };
+    static const unsigned char clamp_rcx[] = {
+        0x31, 0xd2,                 // xor edx, edx
+        0x48, 0x85, 0xc9,           // test rcx, rcx
+        0x48, 0x0f, 0x48, 0xca,     // cmovs rcx, rdx
+        0xba, 0, 0, 0, 0,           // mov edx, max (patched below)
+        0x48, 0x39, 0xd1,           // cmp rcx, rdx
+        0x48, 0x0f, 0x47, 0xca,     // cmova rcx, rdx
+    };
+    int width = cells->width;
+    unsigned int max = width == 4 ? 0xffffffffu : (1u << (8 * width)) - 1;
+
+    switch (ip->op) {
+        case OP_ADD:
+            if (cells->saturate) {
+                emit_add_sat(j, width, ip->off, ip->arg, max);
+            } else {
+                emit_cell_op(j, width, 0x80, 0x81, 0, ip->off);     // add [cell], imm
+                emit_imm(j, width, (unsigned int)ip->arg);
+            }
+            break;
+        case OP_MOVE:
+            // add rbx, imm32
+            emit_u8(j, 0x48); emit_u8(j, 0x81); emit_u8(j, 0xc3); emit_u32(j, ip->arg * width);
+            break;
+        case OP_OUT:
+            emit(j, mov_rdi_r14, sizeof(mov_rdi_r14));
+            emit_load(j, width, 6, ip->off);                           // esi = cell
+            emit_u8(j, 0x41); emit_u8(j, 0xff); emit_u8(j, 0xd4);       // call r12
+            break;
+        case OP_IN:
+            emit(j, mov_rdi_r14, sizeof(mov_rdi_r14));
+            emit_load(j, width, 6, ip->off);                           // esi = cell
+            emit_u8(j, 0x41); emit_u8(j, 0xff); emit_u8(j, 0xd5);       // call r13
+            emit_store(j, width, 0, ip->off);                          // cell = eax
+            break;
+        case OP_CLEAR:
+            emit_set(j, width, ip->off, 0);
+            break;
+        case OP_MUL:
+            emit_load(j, width, 0, ip->src);                           // eax = src
+            if (cells->saturate) {
+                // rcx = clamp(dst + (int64)src * k), then store
+                emit_u8(j, 0x48); emit_u8(j, 0x69); emit_u8(j, 0xc0); emit_u32(j, ip->arg);   // imul rax, rax, imm32
+                emit_load(j, width, 1, ip->off);                       // ecx = dst
+                emit_u8(j, 0x48); emit_u8(j, 0x01); emit_u8(j, 0xc1);   // add rcx, rax
+                emit(j, clamp_rcx, sizeof(clamp_rcx));
+                memcpy(j->code + j->len - sizeof(clamp_rcx) + 10, &max, 4);
+                emit_store(j, width, 1, ip->off);
+            } else {
+                if (ip->arg != 1) {
+                    emit_u8(j, 0x69); emit_u8(j, 0xc0); emit_u32(j, ip->arg);    // imul eax, eax, imm32
+                }
+                emit_cell_op(j, width, 0x00, 0x01, 0, ip->off);         // add [dst], al/ax/eax
+            }
+            break;
+        case OP_SCAN:
+            // rbx = scan(rbx, stride, width)
+            emit(j, mov_rdi_rbx, sizeof(mov_rdi_rbx));
+            emit_u8(j, 0xbe); emit_u32(j, ip->arg);                     // mov esi, imm32
+            emit_u8(j, 0xba); emit_u32(j, width);                       // mov edx, imm32
+            emit_call(j, scan);
+            emit_u8(j, 0x48); emit_u8(j, 0x89); emit_u8(j, 0xc3);       // mov rbx, rax
+            break;
+        case OP_COUNT: {
+            uint64_t counter = (uint64_t)(uintptr_t)(counters + ip->arg);
+            emit_u8(j, 0x48); emit_u8(j, 0xb8); emit(j, &counter, 8);   // mov rax, imm64
+            emit_u8(j, 0x48); emit_u8(j, 0xff); emit_u8(j, 0x00);       // inc qword [rax]
+            break;
+        }
+    }
+}
+
+// Returns NULL when executable memory can't be mapped; the caller then falls
+// back to the interpreter. counters is only read for OP_COUNT. The code is
+// entered at instruction start, which may be inside a loop.
+static jit_fn jit_compile(const Instr* prog, const CellType* cells, uint64_t* counters, size_t start, Jit* j) {
+    size_t n = 0, depth = 0, max_depth = 0;
+    while (prog[n].op != OP_END) {
+        if (prog[n].op == OP_JZ && ++depth > max_depth) max_depth = depth;
+        if (prog[n].op == OP_JNZ) depth--;
+        n++;
+    }
+
+    j->cap = (n * 64 + 64 + 4095) & ~(size_t)4095;
+    j->len = 0;
+    j->code = mmap(NULL, j->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) return NULL;
+
+    size_t* loops = malloc((max_depth + 1) * sizeof(size_t));
+    depth = 0;
+
+    int width = cells->width;
+
+    emit(j, jit_prologue, sizeof(jit_prologue));
+    size_t entry = 0;
+    if (start) {
+        emit_u8(j, 0xe9);                                               // jmp rel32
+        entry = j->len;
+        emit_u32(j, 0);
+    }
+    for (const Instr* ip = prog; ; ip++) {
+        if (entry && ip == prog + start) patch_rel32(j, entry, j->len);
+        if (ip->op == OP_END) break;
+        switch (ip->op) {
+            case OP_JZ:
+            case OP_JNZ:
+                // cmp [rbx], 0; je/jne rel32
+                if (width == 2) emit_u8(j, 0x66);
+                emit_u8(j, width == 1 ? 0x80 : 0x83); emit_u8(j, 0x3b); emit_u8(j, 0x00);
+                emit_u8(j, 0x0f); emit_u8(j, ip->op == OP_JZ ? 0x84 : 0x85);
+                if (ip->op == OP_JZ) {
+                    loops[depth++] = j->len;
+                    emit_u32(j, 0);
+                } else {
+                    size_t head = loops[--depth];
+                    emit_u32(j, 0);
+                    patch_rel32(j, j->len - 4, head + 4);
+                    patch_rel32(j, head, j->len);
+                }
+                break;
+            default:
+                emit_instr(j, ip, cells, counters);
+                break;
+        }
+    }
+    emit(j, jit_epilogue, sizeof(jit_epilogue));
+    free(loops);
+
+    if (mprotect(j->code, j->cap, PROT_READ | PROT_EXEC) != 0) {
+        munmap(j->code, j->cap);
+        return NULL;
+    }
+    return (jit_fn)j->code;
+}
+
+static void jit_free(Jit* j) {
+    munmap(j->code, j->cap);
+}
+
+#endif
+
+// Copies just the eight commands.
+static size_t filter_commands(char* dst, const char* src, size_t n) {
+    size_t len = 0;
+    for (size_t i = 0; i < n; i++) {
+        switch (src[i]) {
+            case '+': case '-': case '>': case '<':
+            case '.': case ',': case '[': case ']':
+                dst[len++] = src[i];
+        }
+    }
+    return len;
+}
+
+// Partial evaluation. Everything a program does before its first ',' is
+// independent of input, so it can be run once at compile time: the output
+// it produced, the tape it left and the instruction it stopped at make up a
+// Prefix, and each later run starts from that state instead of from the
+// beginning. A program that never reads input reduces to constant output.
+// Evaluation also stops at a step budget, on very large output or when the
+// pointer wanders far; any point before the first ',' is a valid place to
+// resume.
+#define PREFIX_BUDGET ((uint64_t)1 << 16)      // instructions, by default for bf_compile
+#define PREFIX_BUDGET_AOT ((uint64_t)1 << 28)  // the AOT result is cached, so it can afford more
+#define PREFIX_MAX_CELLS ((int64_t)1 << 24)
+#define PREFIX_MAX_OUTPUT ((size_t)1 << 24)
+
+typedef struct {
+    unsigned char* out;     // output produced so far
+    size_t out_len;
+    unsigned char* tape;    // cells [lo, lo + cells) in native layout
+    int64_t lo;
+    size_t cells;
+    int64_t ptr;            // current cell
+    size_t resume;          // first instruction not yet run
+} Prefix;
+
+// Cells are held as uint32_t whatever the width and masked or clamped to it.
+typedef struct {
+    uint32_t* v;
+    int64_t base;           // cell index of v[0]
+    size_t len;
+} PrefixTape;
+
+static int prefix_reach(PrefixTape* t, int64_t at) {
+    if (at >= t->base && at < t->base + (int64_t)t->len) return 0;
+    if (at < -PREFIX_MAX_CELLS || at >= PREFIX_MAX_CELLS) return -1;
+    size_t len = t->len * 2;
+    while (at < t->base - (int64_t)(len - t->len) / 2 || at >= t->base + (int64_t)(len + t->len) / 2) len *= 2;
+    int64_t base = t->base - (int64_t)(len - t->len) / 2;
+    uint32_t* v = calloc(len, sizeof(uint32_t));
+    memcpy(v + (t->base - base), t->v, t->len * sizeof(uint32_t));
+    free(t->v);
+    t->v = v;
+    t->base = base;
+    t->len = len;
+    return 0;
+}
+
+typedef struct {
+    PrefixTape t;
+    unsigned char* out;
+    size_t len;
+    size_t cap;
+    int64_t p;
+    const Instr* ip;
+    uint64_t steps;
+    uint64_t top;           // steps run when last outside every loop
+} PrefixRun;
+
+static void prefix_run(const Program* prog, const CellType* cells, uint64_t budget, PrefixRun* r) {
+    r->t = (PrefixTape){ calloc(4096, sizeof(uint32_t)), -2048, 4096 };
+    r->cap = 4096;
+    r->len = 0;
+    r->out = malloc(r->cap);
+    r->p = 0;
+    r->ip = prog->code;
+    r->steps = r->top = 0;
+    PrefixTape* t = &r->t;
+    int64_t depth = 0;
+
+    for (; r->steps < budget && r->ip->op != OP_IN && r->ip->op != OP_END; r->steps++) {
+        const Instr* ip = r->ip;
+        if (depth == 0) r->top = r->steps;
+        if (prefix_reach(t, r->p + ip->off) != 0 || prefix_reach(t, r->p + ip->src) != 0) break;
+        uint32_t* c = t->v + (r->p - t->base);
+        if (ip->op == OP_OUT) {
+            if (r->len == PREFIX_MAX_OUTPUT) break;
+            if (r->len == r->cap) r->out = realloc(r->out, r->cap *= 2);
+            r->out[r->len++] = (unsigned char)c[ip->off];
+        } else if (ip->op == OP_ADD) {
+            c[ip->off] = cell_add(cells, c[ip->off], ip->arg);
+        } else if (ip->op == OP_MOVE) {
+            r->p += ip->arg;
+        } else if (ip->op == OP_JZ) {
+            if (*c == 0) {
+                r->ip = prog->code + ip->arg;
+                continue;
+            }
+            depth++;
+        } else if (ip->op == OP_JNZ) {
+            if (*c) {
+                r->ip = prog->code + ip->arg;
+                continue;
+            }
+            depth--;
+        } else if (ip->op == OP_CLEAR) {
+            c[ip->off] = 0;
+        } else if (ip->op == OP_MUL) {
+            c[ip->off] = cell_add(cells, c[ip->off], (int64_t)c[ip->src] * ip->arg);
+        } else if (ip->op == OP_SCAN) {
+            int64_t q = r->p;
+            while (prefix_reach(t, q) == 0 && t->v[q - t->base]) q += ip->arg;
+            if (prefix_reach(t, q) != 0) break;
+            r->p = q;
+        }
+        r->ip++;
+    }
+    if (depth == 0) r->top = r->steps;
+}
+
+// With whole_loops set the prefix never stops inside a loop, which keeps
+// the residual program's loops intact for a compiler to optimize; it costs
+// a second evaluation when the first one stopped mid-loop.
+static void prefix_eval(const Program* prog, const CellType* cells, uint64_t budget, int whole_loops,
+                        Prefix* pre) {
+    PrefixRun r;
+    prefix_run(prog, cells, budget, &r);
+    if (whole_loops && r.top != r.steps) {
+        uint64_t top = r.top;
+        free(r.t.v);
+        free(r.out);
+        prefix_run(prog, cells, top, &r);
+    }
+    PrefixTape t = r.t;
+
+    // Keep only the span of the tape that isn't zero.
+    size_t first = 0, last = t.len;
+    while (first < t.len && !t.v[first]) first++;
+    while (last > first && !t.v[last - 1]) last--;
+    pre->cells = last - first;
+    pre->lo = t.base + (int64_t)first;
+    pre->tape = malloc(pre->cells * cells->width + 1);
+    for (size_t i = 0; i < pre->cells; i++) {
+        uint32_t v = t.v[first + i];
+        memcpy(pre->tape + i * cells->width, &v, cells->width);    // little-endian
+    }
+    free(t.v);
+    pre->out = r.out;
+    pre->out_len = r.len;
+    pre->ptr = r.p;
+    pre->resume = r.ip - prog->code;
+}
+
+// Puts a fresh tape and io into the state the prefix left, and returns the
+// current cell.
+static char* prefix_apply(const Prefix* pre, char* origin, IO* io, int width) {
+    memcpy(origin + pre->lo * width, pre->tape, pre->cells * width);
+    for (size_t i = 0; i < pre->out_len; i++) io_put(io, pre->out[i]);
+    return origin + pre->ptr * width;
+}
+
+static void prefix_free(Prefix* pre) {
+    free(pre->out);
+    free(pre->tape);
+}
+
+// Bytecode files (--save). The optimized instruction stream is written after
+// a header that records the format version, the cell type it was compiled
+// for and a checksum, and -f loads it back with a single mmap: the
+// instructions are used where they lie, so startup does no parsing and no
+// optimization passes. The command text comes along for --profile, --debug
+// and -c, which need it. Files are in native byte order.
+#define BYTECODE_MAGIC "BFBC"
+#define BYTECODE_VERSION 2
+
+typedef struct {
+    char magic[4];
+    uint32_t version;
+    uint32_t instr_size;    // sizeof(Instr); with byte_order, pins the ABI
+    uint32_t byte_order;    // 0x01020304
+    uint32_t cell_width;
+    uint32_t saturate;
+    uint64_t len;           // instructions, not counting OP_END
+    uint64_t text_len;
+    uint64_t checksum;      // of everything after the header
+} BytecodeHeader;
+
+// The text follows the header. The instructions start at the next 16-byte
+// boundary, and their positions come right after them.
+static size_t bytecode_code_at(uint64_t text_len) {
+    return (sizeof(BytecodeHeader) + text_len + 15) & ~(size_t)15;
+}
+
+// FNV-1a a word at a time, cheap enough to check on every load.
+static uint64_t checksum(const void* data, size_t n) {
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ull;
+    for (; n >= 8; p += 8, n -= 8) {
+        uint64_t w;
+        memcpy(&w, p, 8);
+        h = (h ^ w) * 0x100000001b3ull;
+    }
+    for (; n; p++, n--) h = (h ^ *p) * 0x100000001b3ull;
+    return h;
+}
+
+// Whether a loaded program is one compile() could have made, as far as the
+// engines and the JIT rely on it: only ops they run, OP_END at the end and
+// nowhere else, every JZ and JNZ jumping just past its matching bracket,
+// every scan moving, nothing reaching further than compile() allows, and
+// every position inside the text. The checksum only catches accidents.
+static int bytecode_valid(const Program* prog, size_t text_len) {
+    size_t* stack = malloc((prog->len + 1) * sizeof(size_t));
+    size_t open = 0;
+    int ok = prog->code[prog->len].op == OP_END;
+    for (size_t i = 0; ok && i <= prog->len; i++) {
+        const Instr* in = &prog->code[i];
+        if (prog->pos[i] < 0 || (size_t)prog->pos[i] > text_len) {
+            ok = 0;
+        } else if (i == prog->len) {
+            ok = open == 0;
+        } else if (in->op < OP_ADD || in->op >= OP_COUNT) {
+            // OP_COUNT and OP_TRAP are only ever added in memory.
+            ok = 0;
+        } else if (!instr_in_reach(in) || (in->op == OP_SCAN && in->arg == 0)) {
+            ok = 0;
+        } else if (in->op == OP_JZ) {
+            stack[open++] = i;
+        } else if (in->op == OP_JNZ) {
+            ok = open > 0 && (size_t)in->arg == stack[open - 1] + 1 &&
+                 (size_t)prog->code[stack[open - 1]].arg == i + 1;
+            open--;
+        }
+    }
+    free(stack);
+    return ok;
+}
+
+// Checks a bytecode image of size bytes that starts with BYTECODE_MAGIC and
+// points prog into it. Returns NULL, or what is wrong with the image.
+static const char* bytecode_parse(char* image, size_t size, BytecodeHeader* h, Program* prog) {
+    if (size < sizeof(*h)) return "truncated";
+    memcpy(h, image, sizeof(*h));
+    if (h->version != BYTECODE_VERSION || h->instr_size != sizeof(Instr) || h->byte_order != 0x01020304) {
+        return "from an incompatible build";
+    }
+    size_t body = 0;
+    if (h->text_len > size || h->len >= size / (sizeof(Instr) + sizeof(int)) ||
+        bytecode_code_at(h->text_len) + (body = (h->len + 1) * (sizeof(Instr) + sizeof(int))) > size) {
+        return "truncated";
+    }
+    size_t end = bytecode_code_at(h->text_len) + body;
+    if ((h->cell_width != 1 && h->cell_width != 2 && h->cell_width != 4) || h->saturate > 1 ||
+        checksum(image + sizeof(*h), end - sizeof(*h)) != h->checksum) {
+        return "corrupt";
+    }
+    prog->code = (Instr*)(image + bytecode_code_at(h->text_len));
+    prog->len = h->len;
+    prog->pos = (int*)(prog->code + h->len + 1);
+    prog->mapped = 1;
+    return bytecode_valid(prog, h->text_len) ? NULL : "corrupt";
+}
+
+// A bytecode image handed to bf_compile. It is checked as a file given to
+// -f would be, and the program is copied out, so the caller keeps the image.
+static int program_load(Program* out, CellType* cells, const char* image, size_t size,
+                        char* error, size_t error_len) {
+    char* copy = malloc(size);     // the caller's image may not be aligned for Instr
+    memcpy(copy, image, size);
+    BytecodeHeader h;
+    Program prog;
+    const char* problem = bytecode_parse(copy, size, &h, &prog);
+    if (problem) {
+        snprintf(error, error_len, "Bytecode is %s", problem);
+    } else {
+        out->len = prog.len;
+        out->code = malloc((prog.len + 1) * sizeof(Instr));
+        out->pos = malloc((prog.len + 1) * sizeof(int));
+        memcpy(out->code, prog.code, (prog.len + 1) * sizeof(Instr));
+        memcpy(out->pos, prog.pos, (prog.len + 1) * sizeof(int));
+        out->mapped = 0;
+        *cells = (CellType){ (int)h.cell_width, (int)h.saturate };
+    }
+    free(copy);
+    return problem ? -1 : 0;
+}
+
+// Library interface (brainfuck.h).
+struct bf_program {
+    Program prog;
+    Prefix pre;     // state after the input-independent start of the program
+    CellType cells;
+    int eof;
+    size_t tape_size;
+#if defined(__x86_64__)
+    Jit jit;
+    jit_fn native;  // NULL when interpreting
+#endif
+};
+
+bf_program* bf_compile(const char* source, size_t len, const bf_options* opts,
+                       char* error, size_t error_len) {
+    static const bf_options defaults = { 8, 0, BF_EOF_KEEP, 0, 0, 0 };
+    char ignored[64];
+    if (!opts) opts = &defaults;
+    if (!error) {
+        error = ignored;
+        error_len = sizeof(ignored);
+    }
+    int bits = opts->cell_bits ? opts->cell_bits : 8;
+    if ((bits != 8 && bits != 16 && bits != 32) || opts->eof < BF_EOF_KEEP || opts->eof > BF_EOF_MINUS_ONE ||
+        opts->prefix_steps < -1) {
+        snprintf(error, error_len, "Invalid options");
+        return NULL;
+    }
+
+    bf_program* bp = malloc(sizeof(bf_program));
+    bp->cells = (CellType){ bits / 8, opts->saturate != 0 };
+    bp->eof = opts->eof;
+    bp->tape_size = opts->tape_size ? opts->tape_size : DEFAULT_TAPE_SIZE;
+
+    int failed;
+    if (len >= 4 && memcmp(source, BYTECODE_MAGIC, 4) == 0) {
+        failed = program_load(&bp->prog, &bp->cells, source, len, error, error_len) != 0;
+    } else {
+        char* code = malloc(len + 1);
+        size_t code_len = filter_commands(code, source, len);
+        failed = compile(&bp->prog, code, code_len, &bp->cells, 1, error, error_len) != 0;
+        free(code);
+    }
+    if (failed) {
+        free(bp);
+        return NULL;
+    }
+    // A budget of 0 leaves the prefix empty: runs start at the first instruction.
+    uint64_t prefix_budget = opts->prefix_steps == 0 ? PREFIX_BUDGET
+                           : opts->prefix_steps < 0 ? 0 : (uint64_t)opts->prefix_steps;
+    prefix_eval(&bp->prog, &bp->cells, prefix_budget, 0, &bp->pre);
+#if defined(__x86_64__)
+    bp->native = opts->jit ? jit_compile(bp->prog.code, &bp->cells, NULL, bp->pre.resume, &bp->jit) : NULL;
+#endif
+    return bp;
+}
+
+static void io_connect(IO* io, const bf_program* bp, bf_read_fn read, void* read_ctx,
+                       bf_write_fn write, void* write_ctx) {
+    io_init(io, FLUSH_INPUT, bp->eof);
+    io->read = read;
+    io->read_ctx = read_ctx;
+    io->at_eof = read == NULL;
+    io->write = write;
+    io->write_ctx = write_ctx;
+    if (!write) {
+        io->flush = FLUSH_EXIT;
+        io->out_fd = -1;    // discard
+    }
+}
+
+// One run on a zeroed tape; the tape is left dirty.
+static void run_on_tape(const bf_program* bp, Tape* tape, bf_read_fn read, void* read_ctx,
+                        bf_write_fn write, void* write_ctx) {
+    IO io;
+    io_connect(&io, bp, read, read_ctx, write, write_ctx);
+
+    char* ptr = prefix_apply(&bp->pre, tape->origin, &io, bp->cells.width);
+#if defined(__x86_64__)
+    if (bp->native) {
+        bp->native(ptr, &io, io_out_cb, io_in_cb);
+    } else
+#endif
+    {
+        Exec ex = { ptr, &io, NULL, bp->pre.resume };
+        select_engine(&bp->cells, 0)(bp->prog.code, &ex);
+    }
+    io_free(&io);
+}
+
+int bf_run(const bf_program* bp, bf_read_fn read, void* read_ctx, bf_write_fn write, void* write_ctx) {
+    Tape tape;
+    if (tape_init(&tape, bp->tape_size) != 0) return -1;
+    run_on_tape(bp, &tape, read, read_ctx, write, write_ctx);
+    tape_free(&tape);
+    return 0;
+}
+
+struct bf_state {
+    const bf_program* bp;
+    Tape tape;
+    IO io;
+    Exec ex;
+    uint64_t steps;
+    int done;
+};
+
+bf_state* bf_start(const bf_program* bp, bf_read_fn read, void* read_ctx, bf_write_fn write, void* write_ctx) {
+    bf_state* st = malloc(sizeof(bf_state));
+    if (tape_init(&st->tape, bp->tape_size) != 0) {
+        free(st);
+        return NULL;
+    }
+    st->bp = bp;
+    io_connect(&st->io, bp, read, read_ctx, write, write_ctx);
+    char* ptr = prefix_apply(&bp->pre, st->tape.origin, &st->io, bp->cells.width);
+    st->ex = (Exec){ ptr, &st->io, NULL, bp->pre.resume };
+    st->steps = 0;
+    st->done = 0;
+    return st;
+}
+
+int bf_resume(bf_state* st, uint64_t steps, double seconds) {
+    if (st->done) return BF_DONE;
+    uint64_t budget = steps ? steps : UINT64_MAX;
+    st->ex.budget = budget;
+    st->ex.deadline = seconds > 0 ? now_ns() + (uint64_t)(seconds * 1e9) : 0;
+    st->ex.paused = 0;
+    select_engine(&st->bp->cells, 1)(st->bp->prog.code, &st->ex);
+    st->steps += budget - st->ex.budget;
+    // Hand over what this slice printed rather than holding it until the end.
+    io_flush(&st->io);
+    if (st->ex.paused) return BF_PAUSED;
+    st->done = 1;
+    return BF_DONE;
+}
+
+uint64_t bf_steps(const bf_state* st) {
+    return st->steps;
+}
+
+void bf_state_free(bf_state* st) {
+    if (!st) return;
+    free(st->ex.threaded);
+    io_free(&st->io);
+    tape_free(&st->tape);
+    free(st);
+}
+
+typedef struct {
+    const unsigned char* data;
+    size_t len;
+    unsigned char* out;
+    size_t out_len;
+    size_t out_cap;
+} Buffers;
+
+static size_t buffer_read(void* ctx, unsigned char* buf, size_t n) {
+    Buffers* b = ctx;
+    if (n > b->len) n = b->len;
+    memcpy(buf, b->data, n);
+    b->data += n;
+    b->len -= n;
+    return n;
+}
+
+static void buffer_write(void* ctx, const unsigned char* data, size_t n) {
+    Buffers* b = ctx;
+    if (b->out_len + n > b->out_cap) {
+        while (b->out_len + n > b->out_cap) b->out_cap = b->out_cap ? b->out_cap * 2 : IO_BUFFER_SIZE;
+        b->out = realloc(b->out, b->out_cap);
+    }
+    memcpy(b->out + b->out_len, data, n);
+    b->out_len += n;
+}
+
+int bf_run_buffer(const bf_program* bp, const void* input, size_t input_len,
+                  unsigned char** output, size_t* output_len) {
+    Buffers b = { input, input_len, NULL, 0, 0 };
+    if (bf_run(bp, buffer_read, &b, buffer_write, &b) != 0) {
+        free(b.out);
+        return -1;
+    }
+    *output = b.out;
+    *output_len = b.out_len;
+    return 0;
+}
+
+void bf_free(bf_program* bp) {
+    if (!bp) return;
+#if defined(__x86_64__)
+    if (bp->native) jit_free(&bp->jit);
+#endif
+    prefix_free(&bp->pre);
+    program_free(&bp->prog);
+    free(bp);
+}
+
+// Everything below is the command-line tool.
+#ifndef BF_NO_MAIN
+
+// Program text with everything but the eight commands already stripped.
+// A bytecode file also supplies the compiled program, and code then points
+// into its mapping.
+typedef struct {
+    char* code;
+    size_t len;
+    unsigned char* input;   // stdin bytes after the '!' separator
+    size_t input_len;
+    void* map;              // bytecode file mapping, NULL for plain text
+    size_t map_len;
+    Program prog;           // with map: the program, for cells
+    CellType cells;
+} Source;
+
+static void load_string(Source* src, const char* text) {
+    size_t n = strlen(text);
+    src->code = malloc(n + 1);
+    src->len = filter_commands(src->code, text, n);
+    src->input = NULL;
+    src->input_len = 0;
+    src->map = NULL;
+}
+
+static int save_bytecode(const char* path, const Source* src, const Program* prog, const CellType* cells) {
+    size_t code_at = bytecode_code_at(src->len);
+    size_t body = (prog->len + 1) * (sizeof(Instr) + sizeof(int));
+    unsigned char* buf = calloc(code_at + body, 1);
+    memcpy(buf + sizeof(BytecodeHeader), src->code, src->len);
+    memcpy(buf + code_at, prog->code, (prog->len + 1) * sizeof(Instr));
+    memcpy(buf + code_at + (prog->len + 1) * sizeof(Instr), prog->pos, (prog->len + 1) * sizeof(int));
+
+    BytecodeHeader h = {
+        .version = BYTECODE_VERSION, .instr_size = sizeof(Instr), .byte_order = 0x01020304,
+        .cell_width = cells->width, .saturate = cells->saturate,
+        .len = prog->len, .text_len = src->len,
+        .checksum = checksum(buf + sizeof(BytecodeHeader), code_at + body - sizeof(BytecodeHeader)),
+    };
+    memcpy(h.magic, BYTECODE_MAGIC, 4);
+    memcpy(buf, &h, sizeof(h));
+
+    FILE* f = fopen(path, "wb");
+    int failed = !f || fwrite(buf, 1, code_at + body, f) != code_at + body;
+    if (f && fclose(f) != 0) failed = 1;
+    if (failed) perror(path);
+    free(buf);
+    return failed ? -1 : 0;
+}
+
+// Takes over map, which holds a file that starts with BYTECODE_MAGIC.
+static int load_bytecode(Source* src, const char* path, char* map, size_t size) {
+    BytecodeHeader h;
+    const char* problem = bytecode_parse(map, size, &h, &src->prog);
+    if (problem) {
+        fprintf(stderr, "%s: bytecode file is %s\n", path, problem);
+        munmap(map, size);
+        return -1;
+    }
+    src->code = map + sizeof(h);
+    src->len = h.text_len;
+    src->map = map;
+    src->map_len = size;
+    src->cells = (CellType){ (int)h.cell_width, (int)h.saturate };
+    return 0;
+}
+
+// Reads a file that can't be mapped, such as a pipe or FIFO, into anonymous
+// memory, so that it is used and unmapped just like a mapped file. *text is
+// NULL for an empty file.
+static int read_unmappable(int fd, char** text, size_t* len) {
+    size_t page = sysconf(_SC_PAGESIZE);
+    size_t cap = 0, n = 0;
+    char* buf = NULL;
+    for (;;) {
+        if (n == cap) {
+            size_t grown_cap = cap ? cap * 2 : IO_BUFFER_SIZE;
+            char* grown = mmap(NULL, grown_cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+            if (grown == MAP_FAILED) break;
+            if (buf) {
+                memcpy(grown, buf, n);
+                munmap(buf, cap);
+            }
+            buf = grown;
+            cap = grown_cap;
+        }
+        ssize_t got = read(fd, buf + n, cap - n);
+        if (got < 0 && errno == EINTR) continue;
+        if (got <= 0) {
+            if (got == 0) {
+                // Hand back the pages past the end; unmapping n bytes later
+                // releases the rest.
+                size_t used = (n + page - 1) & ~(page - 1);
+                if (used < cap) munmap(buf + used, cap - used);
+                *text = n ? buf : NULL;
+                *len = n;
+                return 0;
+            }
+            break;
+        }
+        n += got;
+    }
+    int saved = errno;
+    if (buf) munmap(buf, cap);
+    errno = saved;
+    return -1;
+}
+
+// Maps the file instead of reading it, so multi-megabyte sources are filtered
+// straight out of the page cache, and bytecode is used in place. Anything
+// that isn't a regular file is read instead.
+static int load_file(Source* src, const char* path) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        perror(path);
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    src->len = 0;
+    src->input = NULL;
+    src->input_len = 0;
+    src->map = NULL;
+    char* text = NULL;
+    size_t size = st.st_size;
+    if (!S_ISREG(st.st_mode)) {
+        // Pipes, FIFOs and /dev/stdin report no size and can't be mapped.
+        if (read_unmappable(fd, &text, &size) != 0) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    } else if (size > 0) {
+        // Writable so --debug can patch loaded bytecode; the mapping is
+        // private, so the file itself never changes.
+        text = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+        if (text == MAP_FAILED) {
+            perror(path);
+            close(fd);
+            return -1;
+        }
+    }
+    close(fd);
+    if (size >= 4 && memcmp(text, BYTECODE_MAGIC, 4) == 0) return load_bytecode(src, path, text, size);
+
+    src->code = malloc(size + 1);
+    if (text) {
+        madvise(text, size, MADV_SEQUENTIAL);
+        src->len = filter_commands(src->code, text, size);
+        munmap(text, size);
+    }
+    return 0;
+}
+
+// Streams the program from stdin up to EOF or a '!'; whatever follows the
+// '!' is kept as the start of the program's input.
+static int load_stdin(Source* src) {
+    size_t cap = IO_BUFFER_SIZE;
+    char* chunk = malloc(IO_BUFFER_SIZE);
+    src->code = malloc(cap);
+    src->len = 0;
+    src->input = NULL;
+    src->input_len = 0;
+    src->map = NULL;
+
+    for (;;) {
+        ssize_t n = read(STDIN_FILENO, chunk, IO_BUFFER_SIZE);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            perror("stdin");
+            free(chunk);
+            free(src->code);
+            return -1;
+        }
+        if (n == 0) break;
+
+        char* bang = memchr(chunk, '!', n);
+        size_t text_len = bang ? (size_t)(bang - chunk) : (size_t)n;
+        if (src->len + text_len > cap) {
+            while (src->len + text_len > cap) cap *= 2;
+            src->code = realloc(src->code, cap);
+        }
+        src->len += filter_commands(src->code + src->len, chunk, text_len);
+        if (bang) {
+            src->input_len = n - text_len - 1;
+            src->input = malloc(src->input_len + 1);
+            memcpy(src->input, bang + 1, src->input_len);
+            break;
+        }
+    }
+    free(chunk);
+    return 0;
+}
+
+// Queues bytes that were read ahead of the program's own input, e.g. what
+// followed the '!' separator when the program itself came from stdin.
+static void io_preload(IO* io, const unsigned char* data, size_t n) {
+    if (n > IO_BUFFER_SIZE) n = IO_BUFFER_SIZE;
+    memcpy(io->in, data, n);
+    io->in_pos = 0;
+    io->in_len = n;
+}
+
+// The source's program, as loaded from bytecode or compiled now.
+static int source_program(const Source* src, const CellType* cells, Program* out, char* error, size_t error_len) {
+    if (src->map) {
+        *out = src->prog;
+        return 0;
+    }
+    return compile(out, src->code, src->len, cells, 1, error, error_len);
+}
+
+static void source_free(Source* src) {
+    if (src->map) munmap(src->map, src->map_len);
+    else free(src->code);
+    free(src->input);
+}
+
+// Ahead-of-time compilation: the optimized instruction stream is written
+// out as C, built into a shared object by the system compiler, and cached
+// under a hash of the program text and cell type. A later run of the same
+// program finds the object by hash and dlopens it without parsing anything.
+#define AOT_VERSION 2
+
+typedef void (*aot_fn)(char* tape, IO* io, out_fn out, in_fn in, char* (*scan)(char*, int, int));
+
+typedef struct {
+    void* handle;
+} Aot;
+
+static uint64_t fnv1a(uint64_t h, const void* data, size_t n) {
+    const unsigned char* p = data;
+    for (size_t i = 0; i < n; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ull;
+    }
+    return h;
+}
+
+static uint64_t program_hash(const Source* src, const CellType* cells) {
+    int key[3] = { AOT_VERSION, cells->width, cells->saturate };
+    uint64_t h = fnv1a(0xcbf29ce484222325ull, key, sizeof(key));
+    return fnv1a(h, src->code, src->len);
+}
+
+// $BF_CACHE_DIR, else $XDG_CACHE_HOME/brainfuck, else ~/.cache/brainfuck.
+static int cache_dir(char* out, size_t n) {
+    const char* dir = getenv("BF_CACHE_DIR");
+    const char* xdg = getenv("XDG_CACHE_HOME");
+    const char* home = getenv("HOME");
+    if (dir && *dir) snprintf(out, n, "%s", dir);
+    else if (xdg && *xdg) snprintf(out, n, "%s/brainfuck", xdg);
+    else if (home && *home) snprintf(out, n, "%s/.cache/brainfuck", home);
+    else return -1;
+
+    // mkdir -p
+    for (char* c = out + 1; *c; c++) {
+        if (*c != '/') continue;
+        *c = 0;
+        mkdir(out, 0755);
+        *c = '/';
+    }
+    if (mkdir(out, 0755) != 0 && errno != EEXIST) return -1;
+    return 0;
+}
+
+// A byte array as a string literal, which compilers digest much faster than
+// an initializer list.
+static void emit_bytes(FILE* f, const char* name, const unsigned char* data, size_t n) {
+    fprintf(f, "    static const unsigned char %s[%zu] =\n        \"", name, n + 1);
+    for (size_t i = 0; i < n; i++) {
+        unsigned char c = data[i];
+        if (c >= 0x20 && c < 0x7f && c != '"' && c != '\\' && c != '?') fputc(c, f);
+        else fprintf(f, "\\%03o", c);
+        if (i % 64 == 63 && i + 1 < n) fprintf(f, "\"\n        \"");
+    }
+    fprintf(f, "\";\n");
+}
+
+// The prefix's output and tape are baked in as data, and the code for the
+// rest of the program starts where the prefix stopped, entered with a goto
+// if that is inside a loop.
+static void emit_c(FILE* f, const Instr* prog, const CellType* cells, const Prefix* pre) {
+    static const char* types[] = { NULL, "uint8_t", "uint16_t", NULL, "uint32_t" };
+    static const char* maxes[] = { NULL, "UINT8_MAX", "UINT16_MAX", NULL, "UINT32_MAX" };
+    int depth = 1;
+
+    fprintf(f, "#include <stdint.h>\n");
+    fprintf(f, "typedef %s cell;\n", types[cells->width]);
+    fprintf(f, "static inline cell sat(int64_t v) { return v < 0 ? 0 : v > %s ? %s : (cell)v; }\n",
+            maxes[cells->width], maxes[cells->width]);
+    fprintf(f, "void bf_main(char* origin, void* io, void (*out)(void*, int), int (*in)(void*, int),\n");
+    fprintf(f, "             char* (*scan)(char*, int, int)) {\n");
+    if (pre->out_len) {
+        emit_bytes(f, "prefix_out", pre->out, pre->out_len);
+        fprintf(f, "    for (unsigned long i = 0; i < %zu; i++) out(io, prefix_out[i]);\n", pre->out_len);
+    }
+    if (pre->cells) {
+        emit_bytes(f, "prefix_tape", pre->tape, pre->cells * cells->width);
+        fprintf(f, "    for (unsigned long i = 0; i < %zu; i++) (origin + %lld)[i] = prefix_tape[i];\n",
+                pre->cells * cells->width, (long long)pre->lo * cells->width);
+    }
+    fprintf(f, "    cell* p = (cell*)origin + %lld;\n", (long long)pre->ptr);
+    if (prog[pre->resume].op == OP_END) {
+        fprintf(f, "}\n");
+        return;
+    }
+    int nested = 0;
+    for (size_t i = 0; i < pre->resume; i++) nested += prog[i].op == OP_JZ ? 1 : prog[i].op == OP_JNZ ? -1 : 0;
+    if (nested) fprintf(f, "    goto resume;\n");
+    for (const Instr* ip = prog; ip->op != OP_END; ip++) {
+        // Top-level code before the resume point never runs.
+        if (depth == 1 && ip < prog + pre->resume && (ip->op != OP_JZ || (size_t)ip->arg <= pre->resume)) {
+            if (ip->op == OP_JZ) ip = prog + ip->arg - 1;
+            continue;
+        }
+        if (nested && ip == prog + pre->resume) fprintf(f, "resume:;\n");
+        if (ip->op == OP_JNZ) depth--;
+        fprintf(f, "%*s", depth * 4, "");
+        switch (ip->op) {
+            case OP_ADD:
+                if (cells->saturate) fprintf(f, "p[%d] = sat((int64_t)p[%d] + %d);\n", ip->off, ip->off, ip->arg);
+                else fprintf(f, "p[%d] += (cell)%d;\n", ip->off, ip->arg);
                 break;
-            case '<':
-                ptr--;
+            case OP_MOVE:
+                fprintf(f, "p += %d;\n", ip->arg);
                 break;
-            case '+':
-                (*ptr)++;
+            case OP_OUT:
+                fprintf(f, "out(io, p[%d]);\n", ip->off);
                 break;
-            case '-':
-                (*ptr)--;
+            case OP_IN:
+                fprintf(f, "p[%d] = (cell)in(io, p[%d]);\n", ip->off, ip->off);
                 break;
-            case '.':
-                fprintf(stdout, "%c", *ptr);
+            case OP_JZ:
+                fprintf(f, "while (*p) {\n");
+                depth++;
                 break;
-            case ',':
-                scanf("%c", ptr);
+            case OP_JNZ:
+                fprintf(f, "}\n");
                 break;
-            case '[':
-                if (*ptr == 0) {
-                    int loops = 1;
+            case OP_CLEAR:
+                fprintf(f, "p[%d] = 0;\n", ip->off);
+                break;
+            case OP_MUL:
+                if (cells->saturate) {
+                    fprintf(f, "p[%d] = sat((int64_t)p[%d] + (int64_t)p[%d] * %d);\n", ip->off, ip->off, ip->src, ip->arg);
+                } else {
+                    fprintf(f, "p[%d] += (cell)((uint32_t)p[%d] * (uint32_t)%d);\n", ip->off, ip->src, ip->arg);
+                }
+                break;
+            case OP_SCAN:
+                fprintf(f, "p = (cell*)scan((char*)p, %d, %d);\n", ip->arg, cells->width);
+                break;
+        }
+    }
+    fprintf(f, "}\n");
+}
 
-                    while (loops > 0) {
-                        ip++;
-                        if (*ip == '[') loops++;
-                        if (*ip == ']') loops--;
-                    }
+static int run_compiler(const char* c_path, const char* so_path) {
+    const char* cc = getenv("CC");
+    if (!cc || !*cc) cc = "cc";
+    pid_t pid = fork();
+    if (pid < 0) return -1;
+    if (pid == 0) {
+        dup2(STDERR_FILENO, STDOUT_FILENO);
+        execlp(cc, cc, "-O2", "-shared", "-fPIC", "-w", "-o", so_path, c_path, (char*)NULL);
+        _exit(127);
+    }
+    int status;
+    while (waitpid(pid, &status, 0) < 0) {
+        if (errno != EINTR) return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == 0 ? 0 : -1;
+}
+
+// Returns the compiled entry point, building and caching it first if this
+// program hasn't been seen before, or NULL if that isn't possible.
+static aot_fn aot_load(const Source* src, const CellType* cells, Aot* aot) {
+    char dir[4096], so_path[4200], tmp_c[4200], tmp_so[4200];
+    if (cache_dir(dir, sizeof(dir)) != 0) return NULL;
+
+    uint64_t h = program_hash(src, cells);
+    snprintf(so_path, sizeof(so_path), "%s/%016llx.so", dir, (unsigned long long)h);
+
+    if (access(so_path, R_OK) != 0) {
+        // Build under temporary names and rename into place, so concurrent
+        // runs never dlopen a half-written object.
+        snprintf(tmp_c, sizeof(tmp_c), "%s/%016llx.%ld.c", dir, (unsigned long long)h, (long)getpid());
+        snprintf(tmp_so, sizeof(tmp_so), "%s/%016llx.%ld.so", dir, (unsigned long long)h, (long)getpid());
+
+        FILE* f = fopen(tmp_c, "w");
+        if (!f) return NULL;
+        Program prog;
+        char error[64];
+        int failed = source_program(src, cells, &prog, error, sizeof(error)) != 0;
+        if (!failed) {
+            Prefix pre;
+            prefix_eval(&prog, cells, PREFIX_BUDGET_AOT, 1, &pre);
+            emit_c(f, prog.code, cells, &pre);
+            prefix_free(&pre);
+            program_free(&prog);
+        }
+        failed = fclose(f) != 0 || failed || run_compiler(tmp_c, tmp_so) != 0;
+        unlink(tmp_c);
+        if (failed || rename(tmp_so, so_path) != 0) {
+            unlink(tmp_so);
+            return NULL;
+        }
+    }
+
+    aot->handle = dlopen(so_path, RTLD_NOW | RTLD_LOCAL);
+    if (!aot->handle) return NULL;
+    aot_fn fn = (aot_fn)dlsym(aot->handle, "bf_main");
+    if (!fn) dlclose(aot->handle);
+    return fn;
+}
+
+static void aot_free(Aot* aot) {
+    dlclose(aot->handle);
+}
+
+// Profiling: a counter is bumped at the head of every basic block, and
+// per-instruction and per-loop figures are derived from the block counts
+// afterwards, so the hot path pays one increment per block rather than one
+// per instruction. Blocks start at the program entry and after every jump.
+typedef struct {
+    Program code;           // instrumented copy of the program
+    int* block;             // block of each original instruction
+    size_t blocks;
+    uint64_t* counts;
+} Profile;
+
+typedef struct {
+    size_t head;            // index of the loop's OP_JZ
+    uint64_t entries;
+    uint64_t iterations;
+    uint64_t ops;           // executed instructions inside the loop, nested loops included
+} LoopStat;
+
+static void profile_init(Profile* pf, const Program* prog) {
+    size_t n = prog->len;
+    size_t* map = malloc((n + 1) * sizeof(size_t));
+    Instr* code = malloc((2 * n + 2) * sizeof(Instr));
+    int* pos = malloc((2 * n + 2) * sizeof(int));
+    size_t len = 0;
+
+    pf->block = malloc((n + 1) * sizeof(int));
+    pf->blocks = 0;
+    for (size_t i = 0; i <= n; i++) {
+        map[i] = len;
+        if (i == 0 || prog->code[i - 1].op == OP_JZ || prog->code[i - 1].op == OP_JNZ) {
+            pos[len] = prog->pos[i];
+            code[len++] = (Instr){OP_COUNT, (int)pf->blocks++, 0};
+        }
+        pf->block[i] = (int)pf->blocks - 1;
+        pos[len] = prog->pos[i];
+        code[len++] = prog->code[i];
+    }
+    // Jump targets always start a block, so they now land on its counter.
+    for (size_t i = 0; i < len; i++) {
+        if (code[i].op == OP_JZ || code[i].op == OP_JNZ) code[i].arg = (int)map[code[i].arg];
+    }
+    free(map);
+
+    pf->code = (Program){ code, len - 1, pos };
+    pf->counts = calloc(pf->blocks, sizeof(uint64_t));
+}
+
+static void profile_free(Profile* pf) {
+    program_free(&pf->code);
+    free(pf->block);
+    free(pf->counts);
+}
+
+typedef struct {
+    size_t at;
+    uint64_t count;
+} InstrStat;
+
+// Most executed first, and in program order among equals.
+static int instr_cmp(const void* a, const void* b) {
+    const InstrStat* x = a;
+    const InstrStat* y = b;
+    if (x->count != y->count) return x->count < y->count ? 1 : -1;
+    return x->at < y->at ? -1 : x->at > y->at;
+}
+
+static int loop_cmp(const void* a, const void* b) {
+    uint64_t x = ((const LoopStat*)a)->ops, y = ((const LoopStat*)b)->ops;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+// Writes the instruction mix, the hottest instructions and the hottest loops
+// to f. Shares are of executed instructions, which is also how the wall time
+// is apportioned.
+static void profile_report(FILE* f, const Profile* pf, const Program* prog, const char* text, double seconds) {
+    static const char* names[] = {
+        "add", "move", "out", "in", "jz", "jnz", "clear", "mul", "scan",
+    };
+    size_t n = prog->len;
+    uint64_t* before = malloc((n + 1) * sizeof(uint64_t));   // ops executed at indices < i
+    InstrStat* instrs = malloc((n + 1) * sizeof(InstrStat));
+    uint64_t mix[OP_COUNT] = {0};
+    size_t loops = 0;
+
+    before[0] = 0;
+    for (size_t i = 0; i < n; i++) {
+        uint64_t c = pf->counts[pf->block[i]];
+        instrs[i] = (InstrStat){ i, c };
+        before[i + 1] = before[i] + c;
+        mix[prog->code[i].op] += c;
+        if (prog->code[i].op == OP_JZ) loops++;
+    }
+    uint64_t total = before[n];
+
+    LoopStat* stats = malloc((loops + 1) * sizeof(LoopStat));
+    loops = 0;
+    for (size_t i = 0; i < n; i++) {
+        if (prog->code[i].op != OP_JZ) continue;
+        size_t tail = prog->code[i].arg - 1;
+        stats[loops++] = (LoopStat){
+            .head = i,
+            .entries = pf->counts[pf->block[i]],
+            .iterations = pf->counts[pf->block[i + 1]],
+            .ops = before[tail + 1] - before[i + 1],
+        };
+    }
+    qsort(stats, loops, sizeof(LoopStat), loop_cmp);
+    qsort(instrs, n, sizeof(InstrStat), instr_cmp);
+
+    fprintf(f, "\n--- profile: %llu instructions in %.3f s", (unsigned long long)total, seconds);
+    if (seconds > 0) fprintf(f, " (%.0f M/s)", total / seconds / 1e6);
+    fprintf(f, "\n\ninstruction mix:\n");
+    for (int op = 0; op < OP_COUNT; op++) {
+        if (!mix[op]) continue;
+        fprintf(f, "  %-6s %14llu  %5.1f%%\n", names[op], (unsigned long long)mix[op],
+                100.0 * mix[op] / (total ? total : 1));
+    }
+
+    fprintf(f, "\nhottest instructions:\n");
+    fprintf(f, "  %6s %9s %14s  %-6s %-15s %s\n", "share", "time", "count", "op", "commands", "source");
+    for (size_t k = 0; k < n && k < 10 && instrs[k].count; k++) {
+        const InstrStat* in = &instrs[k];
+        // The commands an instruction came from run up to where the next
+        // one's start; a folded loop such as [-] spans its brackets.
+        int from = prog->pos[in->at];
+        int to = prog->pos[in->at + 1] - 1;
+        if (to < from) to = from;
+        double share = (double)in->count / (total ? total : 1);
+        char span[32];
+        snprintf(span, sizeof(span), "%d-%d", from, to);
+        int shown = to - from + 1 > 40 ? 37 : to - from + 1;
+        fprintf(f, "  %5.1f%% %7.1fms %14llu  %-6s %-15s %.*s%s\n", 100 * share, 1000 * share * seconds,
+                (unsigned long long)in->count, names[prog->code[in->at].op], span,
+                shown, text + from, shown < to - from + 1 ? "..." : "");
+    }
+
+    fprintf(f, "\nhottest loops (commands are offsets into the program with comments removed):\n");
+    fprintf(f, "  %6s %9s %14s %10s  %-15s %s\n", "share", "time", "iterations", "entries", "commands", "source");
+    for (size_t k = 0; k < loops && k < 10 && stats[k].ops; k++) {
+        const LoopStat* l = &stats[k];
+        int from = prog->pos[l->head];
+        int to = prog->pos[prog->code[l->head].arg - 1];
+        double share = (double)l->ops / (total ? total : 1);
+        char span[32];
+        snprintf(span, sizeof(span), "%d-%d", from, to);
+        int shown = to - from + 1 > 40 ? 37 : to - from + 1;
+        fprintf(f, "  %5.1f%% %7.1fms %14llu %10llu  %-15s %.*s%s\n", 100 * share, 1000 * share * seconds,
+                (unsigned long long)l->iterations, (unsigned long long)l->entries, span,
+                shown, text + from, shown < to - from + 1 ? "..." : "");
+    }
+
+    free(stats);
+    free(instrs);
+    free(before);
+}
+
+#if defined(__x86_64__)
+
+// Tracing JIT (--trace). The program starts out on a plain interpreter that
+// counts loop iterations. Once a loop is hot, the interpreter records the
+// path one iteration actually takes through it, nested loops unrolled as
+// they ran, and that path is compiled to a straight-line native loop:
+//   - every pointer move is folded into the cell offsets, relative to the
+//     pointer on entry, and applied once per iteration;
+//   - each branch becomes a guard that the cell is (or isn't) zero, and a
+//     failing guard leaves the trace and resumes the interpreter at that
+//     branch;
+//   - values the path itself establishes (a cleared cell, a guard that
+//     found zero) are propagated, so adds to them become stores,
+//     multiplies by them become adds or vanish, and guards they decide are
+//     dropped.
+// Inner loops get hot first and are traced on their own; an outer loop whose
+// iteration doesn't fit in TRACE_MAX is left to the interpreter and its inner
+// traces.
+#define TRACE_HOT 64        // iterations before a loop is recorded
+#define TRACE_MAX 1024      // longest recorded path, in instructions
+
+// Returns the instruction to resume interpreting at, with the pointer in *end.
+typedef size_t (*trace_fn)(char* ptr, IO* io, out_fn out, in_fn in, char** end);
+
+// A recorded instruction, with offsets relative to the pointer on entry.
+// OP_JZ and OP_JNZ are guards that the cell at off is zero or nonzero;
+// resume is the branch the interpreter takes over at if not. OP_SCAN has
+// the pointer offset to apply before it in off.
+typedef struct {
+    Instr in;
+    size_t resume;
+} TraceOp;
+
+typedef struct {
+    unsigned hits;
+    int state;              // LOOP_*
+    Jit jit;
+    trace_fn fn;
+} LoopTrace;
+
+enum { LOOP_COLD, LOOP_TRACED, LOOP_UNTRACEABLE };
+
+static void cell_store(char* p, int width, uint32_t v) {
+    if (width == 1) *(uint8_t*)p = (uint8_t)v;
+    else if (width == 2) *(uint16_t*)p = (uint16_t)v;
+    else *(uint32_t*)p = v;
+}
+
+// Known cell values along a trace, by offset.
+typedef struct {
+    int off[TRACE_MAX];
+    uint32_t value[TRACE_MAX];
+    int n;
+} TraceFacts;
+
+static int trace_known(const TraceFacts* f, int off, uint32_t* v) {
+    for (int k = 0; k < f->n; k++) {
+        if (f->off[k] == off) {
+            *v = f->value[k];
+            return 1;
+        }
+    }
+    return 0;
+}
+
+static void trace_learn(TraceFacts* f, int off, int known, uint32_t v) {
+    for (int k = 0; k < f->n; k++) {
+        if (f->off[k] != off) continue;
+        if (known) {
+            f->value[k] = v;
+        } else {
+            f->n--;
+            f->off[k] = f->off[f->n];
+            f->value[k] = f->value[f->n];
+        }
+        return;
+    }
+    if (known && f->n < TRACE_MAX) {
+        f->off[f->n] = off;
+        f->value[f->n++] = v;
+    }
+}
+
+// cmp ptr[off], 0
+static void emit_test_cell(Jit* j, int width, int off) {
+    emit_cell_op(j, width, 0x80, 0x83, 7, off);
+    emit_u8(j, 0);
+}
+
+static void emit_move(Jit* j, int width, int cells) {
+    if (!cells) return;
+    emit_u8(j, 0x48); emit_u8(j, 0x81); emit_u8(j, 0xc3); emit_u32(j, cells * width);     // add rbx, imm32
+}
+
+// ops is one iteration of the loop closed by the OP_JNZ at loop, after
+// which the pointer has moved by end since the last scan. Returns NULL if executable memory
+// can't be mapped.
+static trace_fn trace_compile(size_t loop, const TraceOp* ops, size_t n, int end,
+                              const CellType* cells, Jit* j) {
+    static const unsigned char mov_r15_r8[] = { 0x4d, 0x89, 0xc7 };
+    static const unsigned char mov_r15_rbx[] = { 0x49, 0x89, 0x1f };    // mov [r15], rbx
+    int width = cells->width;
+
+    j->cap = (n * 80 + 256 + 4095) & ~(size_t)4095;
+    j->len = 0;
+    j->code = mmap(NULL, j->cap, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (j->code == MAP_FAILED) return NULL;
+    size_t* exits = malloc(n * sizeof(size_t));     // rel32 to patch for each guard
+    TraceFacts* facts = malloc(sizeof(TraceFacts));
+    facts->n = 0;
+
+    emit(j, jit_prologue, sizeof(jit_prologue));
+    emit(j, mov_r15_r8, sizeof(mov_r15_r8));
+    size_t top = j->len;
+    for (size_t i = 0; i < n; i++) {
+        Instr in = ops[i].in;
+        uint32_t v, src;
+        int known = trace_known(facts, in.off, &v);
+        exits[i] = 0;
+        switch (in.op) {
+            case OP_JZ:
+            case OP_JNZ:
+                if (known && (v == 0) == (in.op == OP_JZ)) break;
+                emit_test_cell(j, width, in.off);
+                emit_u8(j, 0x0f); emit_u8(j, in.op == OP_JZ ? 0x85 : 0x84);    // jne/je exit
+                exits[i] = j->len;
+                emit_u32(j, 0);
+                if (in.op == OP_JZ) trace_learn(facts, in.off, 1, 0);
+                break;
+            case OP_SCAN:
+                emit_move(j, width, in.off);
+                in.off = 0;
+                emit_instr(j, &in, cells, NULL);
+                facts->n = 0;
+                break;
+            case OP_ADD:
+                if (known) {
+                    v = cell_add(cells, v, in.arg);
+                    emit_set(j, width, in.off, v);
+                    trace_learn(facts, in.off, 1, v);
+                } else {
+                    emit_instr(j, &in, cells, NULL);
                 }
                 break;
-            case ']':
-                if (*ptr) { 
-                    int loops = 1;
-                    while (loops > 0) {
-                        ip--;
-                        if (*ip == '[') loops--;
-                        if (*ip == ']') loops++;
+            case OP_CLEAR:
+                if (!known || v) emit_instr(j, &in, cells, NULL);
+                trace_learn(facts, in.off, 1, 0);
+                break;
+            case OP_MUL:
+                if (!trace_known(facts, in.src, &src)) {
+                    emit_instr(j, &in, cells, NULL);
+                    trace_learn(facts, in.off, 0, 0);
+                } else if (src) {
+                    int64_t k = (int64_t)src * in.arg;
+                    if (!cells->saturate) k = (int32_t)(uint32_t)k;
+                    if (known) {
+                        v = cell_add(cells, v, k);
+                        emit_set(j, width, in.off, v);
+                        trace_learn(facts, in.off, 1, v);
+                    } else if (k >= INT32_MIN && k <= INT32_MAX) {
+                        in = (Instr){ OP_ADD, (int)k, in.off };
+                        emit_instr(j, &in, cells, NULL);
+                    } else {
+                        emit_instr(j, &in, cells, NULL);
                     }
                 }
+                break;
+            case OP_IN:
+                emit_instr(j, &in, cells, NULL);
+                trace_learn(facts, in.off, 0, 0);
+                break;
+            default:
+                emit_instr(j, &in, cells, NULL);
+                break;
+        }
+    }
+    // The loop's own test: around again, or leave just past it.
+    emit_move(j, width, end);
+    emit_test_cell(j, width, 0);
+    emit_u8(j, 0x0f); emit_u8(j, 0x85); emit_u32(j, 0);    // jne top
+    patch_rel32(j, j->len - 4, top);
+    emit_u8(j, 0xb8); emit_u32(j, (unsigned)(loop + 1));  // mov eax, resume
+    size_t leave = j->len;
+    emit(j, mov_r15_rbx, sizeof(mov_r15_rbx));
+    emit(j, jit_epilogue, sizeof(jit_epilogue));
+
+    // Side exits. A guard's offset is also where the interpreter's pointer
+    // is at that branch.
+    for (size_t i = 0; i < n; i++) {
+        if (!exits[i]) continue;
+        patch_rel32(j, exits[i], j->len);
+        emit_move(j, width, ops[i].in.off);
+        emit_u8(j, 0xb8); emit_u32(j, (unsigned)ops[i].resume);    // mov eax, resume
+        emit_u8(j, 0xe9); emit_u32(j, 0);                          // jmp leave
+        patch_rel32(j, j->len - 4, leave);
+    }
+    free(exits);
+    free(facts);
+
+    if (mprotect(j->code, j->cap, PROT_READ | PROT_EXEC) != 0) {
+        munmap(j->code, j->cap);
+        return NULL;
+    }
+    return (trace_fn)j->code;
+}
+
+// Runs prog on the interpreter, handing hot loops over to traces.
+static void trace_run(const Program* prog, const CellType* cells, char* origin, IO* io) {
+    const Instr* code = prog->code;
+    int width = cells->width;
+    LoopTrace* loops = calloc(prog->len + 1, sizeof(LoopTrace));
+    TraceOp* rec = malloc(TRACE_MAX * sizeof(TraceOp));
+    size_t rec_len = 0, rec_loop = SIZE_MAX;    // SIZE_MAX when not recording
+    int delta = 0;                              // pointer movement since the trace began or its last scan
+    char* ptr = origin;
+    size_t ip = 0;
+
+    for (;;) {
+        const Instr* in = &code[ip];
+        if (rec_loop != SIZE_MAX) {
+            if (in->op == OP_JNZ && ip == rec_loop) {
+                LoopTrace* lt = &loops[ip];
+                if (cell_load(ptr, width)) {
+                    lt->fn = trace_compile(ip, rec, rec_len, delta, cells, &lt->jit);
+                    lt->state = lt->fn ? LOOP_TRACED : LOOP_UNTRACEABLE;
+                } else {
+                    lt->hits = 0;   // the loop ended; try again next time it gets hot
+                }
+                rec_loop = SIZE_MAX;
+            } else if (in->op == OP_END || rec_len == TRACE_MAX || delta > (1 << 20) || delta < -(1 << 20)) {
+                loops[rec_loop].state = LOOP_UNTRACEABLE;
+                rec_loop = SIZE_MAX;
+            } else if (in->op == OP_MOVE) {
+                delta += in->arg;
+            } else {
+                TraceOp* t = &rec[rec_len++];
+                t->in = *in;
+                t->in.off += delta;
+                t->in.src += delta;
+                t->resume = ip;
+                if (in->op == OP_JZ || in->op == OP_JNZ) {
+                    t->in.op = cell_load(ptr, width) ? OP_JNZ : OP_JZ;
+                } else if (in->op == OP_SCAN) {
+                    t->in.off = delta;
+                    delta = 0;
+                }
+            }
+        }
+
+        char* cell = ptr + in->off * width;
+        switch (in->op) {
+            case OP_ADD:
+                cell_store(cell, width, cell_add(cells, cell_load(cell, width), in->arg));
+                break;
+            case OP_MOVE:
+                ptr += in->arg * width;
+                break;
+            case OP_OUT:
+                io_put(io, (int)cell_load(cell, width));
+                break;
+            case OP_IN:
+                cell_store(cell, width, (uint32_t)io_get(io, (int)cell_load(cell, width)));
+                break;
+            case OP_JZ:
+                if (!cell_load(ptr, width)) {
+                    ip = in->arg;
+                    continue;
+                }
+                break;
+            case OP_JNZ: {
+                if (!cell_load(ptr, width)) break;
+                LoopTrace* lt = &loops[ip];
+                if (lt->state == LOOP_TRACED && rec_loop == SIZE_MAX) {
+                    ip = lt->fn(ptr, io, io_out_cb, io_in_cb, &ptr);
+                    continue;
+                }
+                if (lt->state == LOOP_COLD && rec_loop == SIZE_MAX && ++lt->hits == TRACE_HOT) {
+                    rec_loop = ip;
+                    rec_len = 0;
+                    delta = 0;
+                }
+                ip = in->arg;
+                continue;
+            }
+            case OP_CLEAR:
+                cell_store(cell, width, 0);
+                break;
+            case OP_MUL:
+                cell_store(cell, width, cell_add(cells, cell_load(cell, width),
+                                                 (int64_t)cell_load(ptr + in->src * width, width) * in->arg));
+                break;
+            case OP_SCAN:
+                ptr = scan(ptr, in->arg, width);
+                break;
+            case OP_END:
+                for (size_t i = 0; i < prog->len; i++) {
+                    if (loops[i].state == LOOP_TRACED) jit_free(&loops[i].jit);
+                }
+                free(loops);
+                free(rec);
+                return;
         }
         ip++;
     }
+}
+
+#endif
+
+typedef struct {
+    int jit;
+    int aot;
+    int trace;
+    int profile;
+    int flush;
+    int eof;
+    size_t tape_size;
+    CellType cells;
+} Options;
+
+static void run(const Source* src, const Options* opt) {
+    Tape tape;
+    if (tape_init(&tape, opt->tape_size) != 0) {
+        perror("tape");
+        exit(1);
+    }
+    IO io;
+    io_init(&io, opt->flush, opt->eof);
+    if (src->input_len) io_preload(&io, src->input, src->input_len);
+
+    if (opt->aot && !opt->trace && !opt->profile) {
+        Aot aot;
+        aot_fn fn = aot_load(src, &opt->cells, &aot);
+        if (fn) {
+            fn(tape.origin, &io, io_out_cb, io_in_cb, scan);
+            aot_free(&aot);
+            io_free(&io);
+            tape_free(&tape);
+            return;
+        }
+        fprintf(stderr, "AOT compilation failed, falling back to the interpreter\n");
+    }
+
+    Program prog;
+    char error[64];
+    if (source_program(src, &opt->cells, &prog, error, sizeof(error)) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+
+    Profile pf;
+    const Program* code = &prog;
+    if (opt->profile) {
+        profile_init(&pf, &prog);
+        code = &pf.code;
+    }
+    struct timespec t0, t1;
+    clock_gettime(CLOCK_MONOTONIC, &t0);
+
+    int done = 0;
+#if defined(__x86_64__)
+    if (opt->trace && !opt->profile) {
+        trace_run(&prog, &opt->cells, tape.origin, &io);
+        done = 1;
+    } else if (opt->jit) {
+        Jit j;
+        jit_fn fn = jit_compile(code->code, &opt->cells, opt->profile ? pf.counts : NULL, 0, &j);
+        if (fn) {
+            fn(tape.origin, &io, io_out_cb, io_in_cb);
+            jit_free(&j);
+            done = 1;
+        } else {
+            fprintf(stderr, "JIT unavailable, falling back to the interpreter\n");
+        }
+    }
+#endif
+    if (!done) {
+        Exec ex = { tape.origin, &io, opt->profile ? pf.counts : NULL, 0 };
+        select_engine(&opt->cells, 0)(code->code, &ex);
+    }
+    io_free(&io);
+
+    if (opt->profile) {
+        clock_gettime(CLOCK_MONOTONIC, &t1);
+        double seconds = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+        profile_report(stderr, &pf, &prog, src->code, seconds);
+        profile_free(&pf);
+    }
+    tape_free(&tape);
+    program_free(&prog);
+}
+
+// Interactive debugger (--debug). The program runs on the interpreter at
+// full speed between stops, which come from traps patched into the
+// instruction stream (see Traps). Commands are read from /dev/tty, or from
+// a script, so the program keeps stdin for its own input. Positions are
+// command indices in the program text with comments removed, as in error
+// messages. The program is compiled from its text without optimization,
+// even when it came from bytecode, so that steps, breakpoints and watches
+// see every + and - and every loop the text has. Pointer moves run as part
+// of the next instruction and can't take a breakpoint themselves.
+#define POS_UNKNOWN INT64_MIN
+
+// Where the pointer is before each instruction, as a cell index, as far as
+// that can be known without running the program: until the first scan or
+// loop whose body moves the pointer.
+static int64_t* pointer_positions(const Program* prog) {
+    int64_t* at = malloc((prog->len + 1) * sizeof(int64_t));
+    unsigned char* balanced = balanced_loops(prog);
+    int64_t p = 0;
+    for (size_t i = 0; i <= prog->len; i++) {
+        const Instr* in = &prog->code[i];
+        if (in->op == OP_JZ && !balanced[i]) p = POS_UNKNOWN;
+        at[i] = p;
+        if (p == POS_UNKNOWN) continue;
+        if (in->op == OP_MOVE) p += in->arg;
+        else if (in->op == OP_SCAN) p = POS_UNKNOWN;
+    }
+    free(balanced);
+    return at;
+}
+
+static void trap_set(Program* prog, Traps* t, size_t i, int kind) {
+    if (i >= prog->len) return;     // OP_END stays: the engines look for it
+    if (!t->kind[i]) {
+        t->op[i] = prog->code[i].op;
+        prog->code[i].op = OP_TRAP;
+    }
+    t->kind[i] |= kind;
+}
+
+static void trap_clear(Program* prog, Traps* t, size_t i, int kind) {
+    if (i >= prog->len || !(t->kind[i] & kind)) return;
+    t->kind[i] &= ~kind;
+    if (!t->kind[i]) prog->code[i].op = t->op[i];
+}
+
+// Guards the instruction after every one that may write a watched cell.
+// Writes whose target is known statically are only guarded when it is one
+// of the watched cells.
+static void watch_guards(Program* prog, Traps* t, const int64_t* at) {
+    for (size_t i = 0; i < prog->len; i++) trap_clear(prog, t, i, TRAP_WATCH);
+    if (!t->watches) return;
+    for (size_t i = 0; i < prog->len; i++) {
+        int op = t->kind[i] ? t->op[i] : prog->code[i].op;
+        if (op != OP_ADD && op != OP_CLEAR && op != OP_MUL && op != OP_IN) continue;
+        int hit = at[i] == POS_UNKNOWN;
+        for (int w = 0; w < t->watches && !hit; w++) hit = at[i] + prog->code[i].off == t->watch[w];
+        if (hit) trap_set(prog, t, i + 1, TRAP_WATCH);
+    }
+}
+
+// First instruction at or after command cmd, or prog->len if none.
+static size_t instr_at_command(const Program* prog, long cmd) {
+    size_t i = 0;
+    while (i < prog->len && prog->pos[i] < cmd) i++;
+    return i;
+}
+
+static void debug_where(const Source* src, const Program* prog, size_t i) {
+    long at = prog->pos[i];
+    long from = at > 30 ? at - 30 : 0;
+    long to = at + 30 < (long)src->len ? at + 30 : (long)src->len;
+    fprintf(stderr, "  at command %ld\n", at);
+    fprintf(stderr, "    %.*s\n", (int)(to - from), src->code + from);
+    fprintf(stderr, "    %*s^\n", (int)(at - from), "");
+}
+
+// Cells the debugger may touch: reading past the reservation would be
+// reported as a tape overflow and end the process.
+static int cell_in_tape(const Tape* tape, int64_t cell, int width) {
+    int64_t limit = (int64_t)(tape->reserved / 2 - TAPE_GUARD) / width;
+    return cell > -limit && cell < limit;
+}
+
+static void debug_help(void) {
+    fprintf(stderr,
+            "  break N, b N     stop before command N, which must not be < or >\n"
+            "  delete N, d N    remove the breakpoint at command N\n"
+            "  watch C, w C     stop when cell C changes\n"
+            "  unwatch C        remove the watchpoint on cell C\n"
+            "  continue, c      run to the next stop\n"
+            "  step, s          run one instruction\n"
+            "  print [C [N]], p show N cells from C (default: around the pointer)\n"
+            "  where            show the current position\n"
+            "  quit, q          stop debugging\n");
+}
+
+static void debug(const Source* src, const Options* opt, const char* script) {
+    FILE* cmds = fopen(script ? script : "/dev/tty", "r");
+    if (!cmds) {
+        perror(script ? script : "/dev/tty");
+        exit(1);
+    }
+    Program prog;
+    char error[64];
+    if (compile(&prog, src->code, src->len, &opt->cells, 0, error, sizeof(error)) != 0) {
+        fprintf(stderr, "%s\n", error);
+        exit(1);
+    }
+    Tape tape;
+    if (tape_init(&tape, opt->tape_size) != 0) {
+        perror("tape");
+        exit(1);
+    }
+    IO io;
+    io_init(&io, opt->flush, opt->eof);
+    if (src->input_len) io_preload(&io, src->input, src->input_len);
+
+    int width = opt->cells.width;
+    Traps t;
+    memset(&t, 0, sizeof(t));
+    t.op = calloc(prog.len + 1, 1);
+    t.kind = calloc(prog.len + 1, 1);
+    t.width = width;
+    int64_t* at = pointer_positions(&prog);
+    engine_fn engine = select_engine(&opt->cells, 0);
+    Exec ex = { tape.origin, &io, NULL, 0 };
+    ex.traps = &t;
+    int running = 1;
+
+    fprintf(stderr, "Stopped at the start\n");
+    debug_where(src, &prog, 0);
+    char line[256];
+    for (;;) {
+        fprintf(stderr, "(bf) ");
+        if (!fgets(line, sizeof(line), cmds)) break;
+        if (script) fputs(line, stderr);
+        char cmd[16] = "";
+        long a = 0, b = 0;
+        int args = sscanf(line, "%15s %ld %ld", cmd, &a, &b) - 1;
+        if (args < 0) continue;
+        int64_t cell = (ex.ptr - tape.origin) / width;
+
+        if (!strcmp(cmd, "q") || !strcmp(cmd, "quit")) {
+            break;
+        } else if ((!strcmp(cmd, "b") || !strcmp(cmd, "break")) && args == 1) {
+            size_t i = instr_at_command(&prog, a);
+            if (i == prog.len) {
+                fprintf(stderr, "No code at or after command %ld\n", a);
+                continue;
+            }
+            if (a < 0) {
+                fprintf(stderr, "No command %ld\n", a);
+                continue;
+            }
+            if (prog.pos[i] != a) {
+                fprintf(stderr, "Command %ld only moves the pointer; the next one that can stop is %d\n", a, prog.pos[i]);
+                continue;
+            }
+            trap_set(&prog, &t, i, TRAP_BREAK);
+            fprintf(stderr, "Breakpoint at command %d\n", prog.pos[i]);
+        } else if ((!strcmp(cmd, "d") || !strcmp(cmd, "delete")) && args == 1) {
+            size_t i = instr_at_command(&prog, a);
+            if (i < prog.len && prog.pos[i] == a) trap_clear(&prog, &t, i, TRAP_BREAK);
+        } else if ((!strcmp(cmd, "w") || !strcmp(cmd, "watch")) && args == 1) {
+            if (t.watches == MAX_WATCHES || !cell_in_tape(&tape, a, width)) {
+                fprintf(stderr, "Can't watch cell %ld\n", a);
+                continue;
+            }
+            t.watch[t.watches] = a;
+            t.watch_at[t.watches] = tape.origin + a * width;
+            t.watch_value[t.watches] = cell_load(t.watch_at[t.watches], width);
+            t.watches++;
+            watch_guards(&prog, &t, at);
+            fprintf(stderr, "Watching cell %ld\n", a);
+        } else if (!strcmp(cmd, "unwatch") && args == 1) {
+            for (int w = 0; w < t.watches; w++) {
+                if (t.watch[w] != a) continue;
+                t.watches--;
+                t.watch[w] = t.watch[t.watches];
+                t.watch_at[w] = t.watch_at[t.watches];
+                t.watch_value[w] = t.watch_value[t.watches];
+                break;
+            }
+            watch_guards(&prog, &t, at);
+        } else if (!strcmp(cmd, "c") || !strcmp(cmd, "continue") || !strcmp(cmd, "s") || !strcmp(cmd, "step")) {
+            if (!running) {
+                fprintf(stderr, "The program has finished\n");
+                continue;
+            }
+            size_t i = ex.start;
+            size_t next[2] = { i + 1, SIZE_MAX };
+            int step = cmd[0] == 's';
+            if (step) {
+                int op = t.kind[i] ? t.op[i] : prog.code[i].op;
+                if (op == OP_JZ || op == OP_JNZ) next[1] = prog.code[i].arg;
+                for (int k = 0; k < 2; k++) {
+                    if (next[k] != SIZE_MAX) trap_set(&prog, &t, next[k], TRAP_STEP);
+                }
+            }
+            t.pass = t.kind[i] ? i : SIZE_MAX;
+            ex.paused = 0;
+            engine(prog.code, &ex);
+            io_flush(&io);
+            if (step) {
+                for (int k = 0; k < 2; k++) {
+                    if (next[k] != SIZE_MAX) trap_clear(&prog, &t, next[k], TRAP_STEP);
+                }
+            }
+            if (!ex.paused) {
+                // Writes just before the end have no instruction to guard them.
+                for (int w = 0; w < t.watches; w++) {
+                    uint32_t v = cell_load(t.watch_at[w], width);
+                    if (v != t.watch_value[w]) {
+                        fprintf(stderr, "Cell %lld changed from %u to %u\n", (long long)t.watch[w], t.watch_value[w], v);
+                    }
+                }
+                running = 0;
+                fprintf(stderr, "The program has finished\n");
+                ex.start = prog.len;
+                continue;
+            }
+            if (t.hit & TRAP_WATCH) {
+                int w = t.hit_watch;
+                fprintf(stderr, "Cell %lld changed from %u to %u\n",
+                        (long long)t.watch[w], t.hit_old, t.watch_value[w]);
+            } else if (t.hit & TRAP_BREAK) {
+                fprintf(stderr, "Breakpoint\n");
+            }
+            debug_where(src, &prog, ex.start);
+        } else if (!strcmp(cmd, "p") || !strcmp(cmd, "print")) {
+            int64_t from = args >= 1 ? a : cell - 4;
+            int64_t n = args >= 2 ? b : args == 1 ? 1 : 9;
+            fprintf(stderr, "  pointer at cell %lld\n", (long long)cell);
+            for (int64_t c = from; c < from + n && n <= 4096; c++) {
+                if (!cell_in_tape(&tape, c, width)) continue;
+                fprintf(stderr, "  %c cell %lld: %u\n", c == cell ? '>' : ' ', (long long)c,
+                        cell_load(tape.origin + c * width, width));
+            }
+        } else if (!strcmp(cmd, "where")) {
+            if (running) debug_where(src, &prog, ex.start);
+            else fprintf(stderr, "The program has finished\n");
+        } else {
+            debug_help();
+        }
+    }
+
+    fclose(cmds);
+    free(at);
+    free(t.op);
+    free(t.kind);
+    io_free(&io);
+    tape_free(&tape);
+    program_free(&prog);
+}
+
+// Batch mode: one compiled program over many inputs, run on a pool of
+// worker threads that each keep a tape for all their runs. Outputs are
+// written to stdout in input order as soon as every earlier one is done.
+typedef struct {
+    const char* path;       // input file, or NULL for an inline input
+    const unsigned char* data;
+    size_t len;
+    unsigned char* out;
+    size_t out_len;
+    int done;
+} Job;
+
+typedef struct {
+    const bf_program* bp;
+    Job* jobs;
+    size_t count;
+    size_t next;            // next job to claim
+    pthread_mutex_t lock;
+    pthread_cond_t finished;
+} Batch;
+
+static int read_all(const char* path, unsigned char** data, size_t* len) {
+    int fd = open(path, O_RDONLY);
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) != 0) {
+        if (fd >= 0) close(fd);
+        return -1;
+    }
+    *data = malloc(st.st_size + 1);
+    *len = 0;
+    while (*len < (size_t)st.st_size) {
+        ssize_t n = read(fd, *data + *len, st.st_size - *len);
+        if (n < 0 && errno == EINTR) continue;
+        if (n <= 0) break;
+        *len += n;
+    }
+    close(fd);
+    return 0;
+}
+
+// Zeroes the committed window so the tape can be reused for the next input.
+static void tape_reset(Tape* t) {
+    madvise(t->lo, t->hi - t->lo, MADV_DONTNEED);
+}
+
+static void* batch_worker(void* arg) {
+    Batch* b = arg;
+    Tape tape;
+    if (tape_init(&tape, b->bp->tape_size) != 0) {
+        perror("tape");
+        exit(1);
+    }
+    for (;;) {
+        size_t i = __atomic_fetch_add(&b->next, 1, __ATOMIC_RELAXED);
+        if (i >= b->count) break;
+        Job* job = &b->jobs[i];
+        unsigned char* data = NULL;
+        Buffers buf = { job->data, job->len, NULL, 0, 0 };
+        if (job->path) {
+            if (read_all(job->path, &data, &buf.len) != 0) perror(job->path);
+            buf.data = data;
+        }
+        run_on_tape(b->bp, &tape, buffer_read, &buf, buffer_write, &buf);
+        tape_reset(&tape);
+        free(data);
+
+        pthread_mutex_lock(&b->lock);
+        job->out = buf.out;
+        job->out_len = buf.out_len;
+        job->done = 1;
+        pthread_cond_broadcast(&b->finished);
+        pthread_mutex_unlock(&b->lock);
+    }
+    tape_free(&tape);
+    return NULL;
+}
+
+static int path_cmp(const void* a, const void* b) {
+    return strcmp(((const Job*)a)->path, ((const Job*)b)->path);
+}
+
+// A directory supplies one input per regular file, in name order; any other
+// file supplies one input per line, newline included.
+static Job* batch_inputs(const char* path, size_t* count, unsigned char** text) {
+    size_t cap = 64;
+    Job* jobs = malloc(cap * sizeof(Job));
+    *count = 0;
+    *text = NULL;
+
+    DIR* dir = opendir(path);
+    if (dir) {
+        struct dirent* e;
+        while ((e = readdir(dir))) {
+            char* file = malloc(strlen(path) + strlen(e->d_name) + 2);
+            struct stat st;
+            sprintf(file, "%s/%s", path, e->d_name);
+            if (stat(file, &st) != 0 || !S_ISREG(st.st_mode)) {
+                free(file);
+                continue;
+            }
+            if (*count == cap) jobs = realloc(jobs, (cap *= 2) * sizeof(Job));
+            jobs[(*count)++] = (Job){ .path = file };
+        }
+        closedir(dir);
+        qsort(jobs, *count, sizeof(Job), path_cmp);
+        return jobs;
+    }
+
+    size_t len;
+    if (read_all(path, text, &len) != 0) {
+        perror(path);
+        free(jobs);
+        return NULL;
+    }
+    for (size_t start = 0; start < len;) {
+        unsigned char* nl = memchr(*text + start, '\n', len - start);
+        size_t end = nl ? (size_t)(nl - *text) + 1 : len;
+        if (*count == cap) jobs = realloc(jobs, (cap *= 2) * sizeof(Job));
+        jobs[(*count)++] = (Job){ .data = *text + start, .len = end - start };
+        start = end;
+    }
+    return jobs;
+}
+
+static int run_batch(const Source* src, const Options* opt, const char* inputs, int threads) {
+    bf_options bo = { opt->cells.width * 8, opt->cells.saturate, opt->eof, opt->jit, opt->tape_size, 0 };
+    char error[64];
+    // Bytecode is handed over whole, so the batch runs the program the file
+    // holds, as a single run does, rather than compiling its text again.
+    bf_program* bp = src->map ? bf_compile(src->map, src->map_len, &bo, error, sizeof(error))
+                              : bf_compile(src->code, src->len, &bo, error, sizeof(error));
+    if (!bp) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+
+    Batch b = { .bp = bp, .next = 0 };
+    unsigned char* text;
+    b.jobs = batch_inputs(inputs, &b.count, &text);
+    if (!b.jobs) {
+        bf_free(bp);
+        return 1;
+    }
+    pthread_mutex_init(&b.lock, NULL);
+    pthread_cond_init(&b.finished, NULL);
+
+    if (threads <= 0) threads = (int)sysconf(_SC_NPROCESSORS_ONLN);
+    if ((size_t)threads > b.count) threads = (int)b.count;
+    pthread_t* pool = malloc((threads + 1) * sizeof(pthread_t));
+    for (int t = 0; t < threads; t++) pthread_create(&pool[t], NULL, batch_worker, &b);
+
+    for (size_t i = 0; i < b.count; i++) {
+        pthread_mutex_lock(&b.lock);
+        while (!b.jobs[i].done) pthread_cond_wait(&b.finished, &b.lock);
+        pthread_mutex_unlock(&b.lock);
+        write_all(STDOUT_FILENO, b.jobs[i].out, b.jobs[i].out_len);
+        free(b.jobs[i].out);
+        free((char*)b.jobs[i].path);
+    }
+
+    for (int t = 0; t < threads; t++) pthread_join(pool[t], NULL);
+    free(pool);
+    free(b.jobs);
+    free(text);
+    pthread_mutex_destroy(&b.lock);
+    pthread_cond_destroy(&b.finished);
+    bf_free(bp);
+    return 0;
+}
+
+static int save_program(const Source* src, const Options* opt, const char* path) {
+    Program prog;
+    char error[64];
+    if (source_program(src, &opt->cells, &prog, error, sizeof(error)) != 0) {
+        fprintf(stderr, "%s\n", error);
+        return 1;
+    }
+    int failed = save_bytecode(path, src, &prog, &opt->cells) != 0;
+    program_free(&prog);
+    return failed;
+}
 
+static void usage(const char* argv0) {
+    fprintf(stderr, "Usage: %s [options] \"<brainfuck-code>\"\n", argv0);
+    fprintf(stderr, "       %s [options] -f <file>\n", argv0);
+    fprintf(stderr, "       %s [options] -      (program on stdin, input after '!')\n", argv0);
+    fprintf(stderr, "  -f FILE       read the program from FILE\n");
+    fprintf(stderr, "  -j            compile to native x86-64 code before running\n");
+    fprintf(stderr, "  -c            translate to C, build with $CC and cache the result by hash\n");
+    fprintf(stderr, "  --trace       interpret, compiling hot loop paths to native x86-64 code\n");
+    fprintf(stderr, "  --profile     count executed blocks and report the hottest instructions\n");
+    fprintf(stderr, "                and loops on stderr\n");
+    fprintf(stderr, "  --debug       run under the debugger, reading commands from the terminal\n");
+    fprintf(stderr, "  --debug=FILE  the same with commands from FILE\n");
+    fprintf(stderr, "  --flush=MODE  when to write output: newline, input (default), exit, never\n");
+    fprintf(stderr, "  --eof=MODE    what ',' stores at end of input: keep (default), 0, -1\n");
+    fprintf(stderr, "  --tape=CELLS  initial tape size (default %d); it grows on demand\n", DEFAULT_TAPE_SIZE);
+    fprintf(stderr, "  --cell=BITS   cell width: 8 (default), 16 or 32\n");
+    fprintf(stderr, "  --saturate    clamp cells at 0 and their maximum instead of wrapping\n");
+    fprintf(stderr, "  --save=FILE   write the optimized program to FILE as bytecode instead of\n");
+    fprintf(stderr, "                running it; -f runs such files, with the cell type they were\n");
+    fprintf(stderr, "                compiled for\n");
+    fprintf(stderr, "  --batch=PATH  run once per file in directory PATH, or per line of file PATH,\n");
+    fprintf(stderr, "                in parallel, writing the outputs in order\n");
+    fprintf(stderr, "  --jobs=N      worker threads for --batch (default: one per CPU)\n");
 }
 
 int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        fprintf(stderr, "Usage: %s \"<brainfuck-code>\"\n", argv[0]);
+    Options opt = {
+        .jit = 0, .aot = 0, .trace = 0, .profile = 0, .flush = FLUSH_INPUT, .eof = EOF_KEEP, .tape_size = DEFAULT_TAPE_SIZE,
+        .cells = { .width = 1, .saturate = 0 },
+    };
+    static const char* flush_modes[] = { "newline", "input", "exit", "never" };
+    static const char* eof_modes[] = { "keep", "0", "-1" };
+    const char* path = NULL;
+    const char* batch = NULL;
+    const char* debug_script = NULL;
+    const char* save = NULL;
+    int debugging = 0;
+    int jobs = 0;
+    int i;
+
+    // Anything that isn't a known option is the program, since brainfuck
+    // code often starts with '-'.
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-j") == 0) {
+            opt.jit = 1;
+        } else if (strcmp(argv[i], "-c") == 0) {
+            opt.aot = 1;
+        } else if (strcmp(argv[i], "--trace") == 0) {
+            opt.trace = 1;
+        } else if (strcmp(argv[i], "--profile") == 0) {
+            opt.profile = 1;
+        } else if (strcmp(argv[i], "--debug") == 0) {
+            debugging = 1;
+        } else if (strncmp(argv[i], "--debug=", 8) == 0) {
+            debugging = 1;
+            debug_script = argv[i] + 8;
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            path = argv[++i];
+        } else if (strncmp(argv[i], "--flush=", 8) == 0) {
+            opt.flush = -1;
+            for (int m = 0; m < 4; m++) {
+                if (strcmp(argv[i] + 8, flush_modes[m]) == 0) opt.flush = m;
+            }
+            if (opt.flush < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--eof=", 6) == 0) {
+            opt.eof = -1;
+            for (int m = 0; m < 3; m++) {
+                if (strcmp(argv[i] + 6, eof_modes[m]) == 0) opt.eof = m;
+            }
+            if (opt.eof < 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--tape=", 7) == 0) {
+            char* end;
+            opt.tape_size = strtoull(argv[i] + 7, &end, 10);
+            if (*end || opt.tape_size == 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strncmp(argv[i], "--cell=", 7) == 0) {
+            int bits = atoi(argv[i] + 7);
+            if (bits != 8 && bits != 16 && bits != 32) {
+                usage(argv[0]);
+                return 1;
+            }
+            opt.cells.width = bits / 8;
+        } else if (strcmp(argv[i], "--saturate") == 0) {
+            opt.cells.saturate = 1;
+        } else if (strncmp(argv[i], "--save=", 7) == 0) {
+            save = argv[i] + 7;
+        } else if (strncmp(argv[i], "--batch=", 8) == 0) {
+            batch = argv[i] + 8;
+        } else if (strncmp(argv[i], "--jobs=", 7) == 0) {
+            jobs = atoi(argv[i] + 7);
+            if (jobs <= 0) {
+                usage(argv[0]);
+                return 1;
+            }
+        } else if (strcmp(argv[i], "--") == 0) {
+            i++;
+            break;
+        } else {
+            break;
+        }
+    }
+
+    Source src;
+    if (path) {
+        if (load_file(&src, path) != 0) return 1;
+    } else if (i < argc && strcmp(argv[i], "-") == 0) {
+        if (load_stdin(&src) != 0) return 1;
+    } else if (i < argc) {
+        load_string(&src, argv[i]);
+    } else {
+        usage(argv[0]);
+        return 1;
     }
 
-    run(argv[1]);
-}
\ No newline at end of file
+    if (src.map) opt.cells = src.cells;
+
+    int status = 0;
+    if (save) status = save_program(&src, &opt, save);
+    else if (debugging) debug(&src, &opt, debug_script);
+    else if (batch) status = run_batch(&src, &opt, batch, jobs);
+    else run(&src, &opt);
+    source_free(&src);
+    return status;
+}
+
+#endif
@@ -0,0 +1,94 @@
+// Embedding interface to brainfuck.c. Build brainfuck.c with -DBF_NO_MAIN
+// and link it into the host. A program is compiled once into a handle that
+// can be run any number of times, from any number of threads, each run on a
+// tape of its own.
+//
+// The tape grows through a SIGSEGV handler that the first run installs with
+// sigaction. Faults outside a tape go on to the handler that was installed
+// before it, or get the default action if there was none. A host that
+// installs its own SIGSEGV handler later must pass on the faults it doesn't
+// handle to the previous one in the same way, or tapes stop growing. A
+// program that runs off the end of the tape's address reservation ends the
+// whole process, as it would from the command line.
+#ifndef BRAINFUCK_H
+#define BRAINFUCK_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef struct bf_program bf_program;
+typedef struct bf_state bf_state;
+
+// What ',' stores once input is exhausted.
+enum {
+    BF_EOF_KEEP,        // leave the cell unchanged
+    BF_EOF_ZERO,        // store 0
+    BF_EOF_MINUS_ONE,   // store -1 (all bits set)
+};
+
+typedef struct {
+    int cell_bits;      // 8, 16 or 32; 0 means 8
+    int saturate;       // clamp cells instead of wrapping
+    int eof;            // BF_EOF_*
+    int jit;            // compile to native code where supported
+    size_t tape_size;   // initial tape size in cells; 0 for the default
+    int64_t prefix_steps;   // see below; 0 for the default, -1 to turn it off
+} bf_options;
+
+// bf_compile runs what the program does before its first ',' once, at
+// compile time, and every run starts from where that left off. It runs at
+// most prefix_steps instructions, so a program that loops before reading
+// costs at most that much per compile. The default is small; raise it for a
+// program compiled once and run many times.
+
+// Output is handed over in chunks as the run flushes it. read stores up to n
+// bytes of input in buf and returns how many, 0 at end of input.
+typedef void (*bf_write_fn)(void* ctx, const unsigned char* data, size_t n);
+typedef size_t (*bf_read_fn)(void* ctx, unsigned char* buf, size_t n);
+
+// Returns NULL on a syntax error, a pointer move too large for the tape or
+// bad options, with a message in error when it is non-NULL. opts may be
+// NULL for the defaults. source may also be a bytecode file written by
+// `brainfuck --save`; it is checked as -f would check it, and its cell type
+// is used in place of cell_bits and saturate.
+bf_program* bf_compile(const char* source, size_t len, const bf_options* opts,
+                       char* error, size_t error_len);
+
+// Runs the program with input from read and output to write. Either
+// callback may be NULL: no input, or output discarded. Returns 0, or -1 if
+// no tape could be set up.
+int bf_run(const bf_program* prog, bf_read_fn read, void* read_ctx,
+           bf_write_fn write, void* write_ctx);
+
+// Runs the program on an input buffer and returns its whole output in a
+// malloc'ed buffer that the caller frees.
+int bf_run_buffer(const bf_program* prog, const void* input, size_t input_len,
+                  unsigned char** output, size_t* output_len);
+
+void bf_free(bf_program* prog);
+
+// Resumable runs, for multiplexing many programs on one thread. A run
+// advances one slice per bf_resume and keeps its tape, pointer, position and
+// buffered input in the bf_state between slices. A slice ends at a loop
+// back-edge once it has taken `steps` of them or `seconds` have passed;
+// either may be 0 for no limit. Straight-line code between back-edges is
+// bounded by the program's length, so every slice is bounded too. Resumable
+// runs are always interpreted, whatever the program's jit option says.
+enum {
+    BF_DONE,            // the program has finished
+    BF_PAUSED,          // the slice ran out; call bf_resume again
+};
+
+// Returns NULL if no tape could be set up. The callbacks are as for bf_run;
+// output is handed over at the end of every slice at the latest.
+bf_state* bf_start(const bf_program* prog, bf_read_fn read, void* read_ctx,
+                   bf_write_fn write, void* write_ctx);
+int bf_resume(bf_state* state, uint64_t steps, double seconds);
+
+// Loop back-edges taken so far. Whatever ran at compile time before the
+// run's starting point is not counted here, or in any slice's steps.
+uint64_t bf_steps(const bf_state* state);
+
+void bf_state_free(bf_state* state);
+
+#endif
@@ -0,0 +1,196 @@
+// Interpreter core, instantiated once per cell type by brainfuck.c.
+// Before including, define:
+//   ENGINE    name of the function to generate
+//   CELL      unsigned cell type
+//   CELL_MAX  largest cell value
+//   SATURATE  1 to clamp at 0 and CELL_MAX, 0 to wrap around
+//   BUDGET    1 to charge every taken loop back-edge against ex->budget and
+//             pause before it when it runs out, 0 to run to the end
+// Every macro is undefined again at the end so the next instance starts clean.
+
+#if SATURATE
+#define CLAMP(v) ((v) < 0 ? 0 : (v) > (int64_t)CELL_MAX ? CELL_MAX : (CELL)(v))
+#define ADD_TO(cell, n) ((cell) = CLAMP((int64_t)(cell) + (n)))
+#else
+#define ADD_TO(cell, n) ((cell) += (CELL)(n))
+#endif
+
+// Takes the back-edge of the JNZ at `at`. The budgeted build charges it
+// first; out of budget, it pauses on that JNZ, so the resumed run retests the
+// cell and takes the edge then, and a slice never takes more than it counts.
+#if BUDGET
+#define BACK_EDGE(at, target) {                                     \
+        if (fuel == 0 && (fuel = budget_next(ex)) == 0) {           \
+            ip = (at);                                              \
+            goto paused;                                            \
+        }                                                           \
+        fuel--;                                                     \
+        ip = prog + (target);                                       \
+        DISPATCH();                                                 \
+    }
+#else
+#define BACK_EDGE(at, target) { ip = prog + (target); DISPATCH(); }
+#endif
+
+static void ENGINE(const Instr* prog, Exec* ex) {
+    CELL* ptr = (CELL*)ex->ptr;
+    IO* io = ex->io;
+
+    const Instr* ip = prog + ex->start;
+#if BUDGET
+    uint64_t fuel = 0;      // back-edges left before asking budget_next for more
+#endif
+
+#if THREADED
+    static void* const labels[] = {
+        [OP_ADD] = &&op_add, [OP_MOVE] = &&op_move, [OP_OUT] = &&op_out,
+        [OP_IN] = &&op_in, [OP_JZ] = &&op_jz, [OP_JNZ] = &&op_jnz,
+        [OP_CLEAR] = &&op_clear, [OP_MUL] = &&op_mul, [OP_SCAN] = &&op_scan,
+        [OP_COUNT] = &&op_count, [OP_TRAP] = &&op_trap, [OP_END] = &&op_end,
+    };
+    // A resumable run enters once per slice, so the budgeted build keeps the
+    // table from its first slice in ex->threaded rather than rebuilding it.
+    // The others rebuild it every time, as the debugger patches ops between
+    // calls.
+    void** code = BUDGET ? ex->threaded : NULL;
+    if (!code) {
+        size_t n = 0;
+        while (prog[n].op != OP_END) n++;
+        code = malloc((n + 1) * sizeof(void*));
+
+        // Superinstructions for the sequences that dominate an op-pair/triple
+        // count over typical programs: a block's trailing move followed by the
+        // loop test, adds to neighbouring cells, and clear-then-add (a constant
+        // store). Nothing jumps into the middle of these sequences, since jump
+        // targets always directly follow a JZ or JNZ.
+        for (size_t i = 0; i <= n; i++) {
+            const Instr* in = prog + i;
+            int a = in[0].op;
+            int b = i + 1 <= n ? in[1].op : OP_END;
+            int c = i + 2 <= n ? in[2].op : OP_END;
+            if (a == OP_ADD && b == OP_MOVE && c == OP_JNZ) code[i] = &&op_add_move_jnz;
+            else if (a == OP_ADD && b == OP_MOVE && c == OP_JZ) code[i] = &&op_add_move_jz;
+            else if (a == OP_MOVE && b == OP_JNZ) code[i] = &&op_move_jnz;
+            else if (a == OP_MOVE && b == OP_JZ) code[i] = &&op_move_jz;
+            else if (a == OP_ADD && b == OP_ADD) code[i] = &&op_add_add;
+            else if (a == OP_CLEAR && b == OP_ADD && in[0].off == in[1].off) code[i] = &&op_set;
+            else code[i] = labels[a];
+        }
+    }
+
+    DISPATCH();
+#else
+    int op;
+    for (;;) {
+        op = ip->op;
+    redispatch:
+        switch (op) {
+#endif
+    CASE(OP_ADD, op_add)
+        ADD_TO(ptr[ip->off], ip->arg);
+        NEXT();
+    CASE(OP_MOVE, op_move)
+        ptr += ip->arg;
+        NEXT();
+    CASE(OP_OUT, op_out)
+        io_put(io, (int)ptr[ip->off]);
+        NEXT();
+    CASE(OP_IN, op_in)
+        ptr[ip->off] = (CELL)io_get(io, (int)ptr[ip->off]);
+        NEXT();
+    CASE(OP_JZ, op_jz)
+        if (*ptr == 0) {
+            ip = prog + ip->arg;
+            DISPATCH();
+        }
+        NEXT();
+    CASE(OP_JNZ, op_jnz)
+        if (*ptr) BACK_EDGE(ip, ip->arg);
+        NEXT();
+    CASE(OP_CLEAR, op_clear)
+        ptr[ip->off] = 0;
+        NEXT();
+    CASE(OP_MUL, op_mul)
+        ADD_TO(ptr[ip->off], (int64_t)ptr[ip->src] * ip->arg);
+        NEXT();
+    CASE(OP_SCAN, op_scan)
+        ptr = (CELL*)scan((char*)ptr, ip->arg, sizeof(CELL));
+        NEXT();
+    CASE(OP_COUNT, op_count)
+        ex->counters[ip->arg]++;
+        NEXT();
+    CASE(OP_TRAP, op_trap)
+#if THREADED
+        {
+            int op = trap_hit(ex->traps, ip - prog);
+            if (op == OP_TRAP) goto paused;
+            goto *labels[op];
+        }
+#else
+        op = trap_hit(ex->traps, ip - prog);
+        if (op == OP_TRAP) goto paused;
+        goto redispatch;
+#endif
+    CASE(OP_END, op_end)
+        goto done;
+#if THREADED
+    op_add_add:
+        ADD_TO(ptr[ip[0].off], ip[0].arg);
+        ADD_TO(ptr[ip[1].off], ip[1].arg);
+        SKIP(2);
+    op_set:
+        ptr[ip[1].off] = 0;
+        ADD_TO(ptr[ip[1].off], ip[1].arg);
+        SKIP(2);
+    op_move_jz:
+        ptr += ip[0].arg;
+        if (*ptr == 0) {
+            ip = prog + ip[1].arg;
+            DISPATCH();
+        }
+        SKIP(2);
+    op_move_jnz:
+        ptr += ip[0].arg;
+        if (*ptr) BACK_EDGE(ip + 1, ip[1].arg);
+        SKIP(2);
+    op_add_move_jz:
+        ADD_TO(ptr[ip[0].off], ip[0].arg);
+        ptr += ip[1].arg;
+        if (*ptr == 0) {
+            ip = prog + ip[2].arg;
+            DISPATCH();
+        }
+        SKIP(3);
+    op_add_move_jnz:
+        ADD_TO(ptr[ip[0].off], ip[0].arg);
+        ptr += ip[1].arg;
+        if (*ptr) BACK_EDGE(ip + 2, ip[2].arg);
+        SKIP(3);
+#else
+        }
+    }
+#endif
+
+paused:
+    ex->start = ip - prog;
+    ex->paused = 1;
+done:
+#if THREADED && BUDGET
+    ex->threaded = code;
+#elif THREADED
+    free(code);
+#endif
+#if BUDGET
+    ex->budget += fuel;
+#endif
+    ex->ptr = (char*)ptr;
+}
+
+#undef ADD_TO
+#undef BACK_EDGE
+#undef CLAMP
+#undef ENGINE
+#undef CELL
+#undef CELL_MAX
+#undef SATURATE
+#undef BUDGET
@@ -0,0 +1,90 @@
+// Checks that resumable runs count loop back-edges exactly: whatever the
+// slice size, bf_steps at the end and the output must match a run done in a
+// single slice.
+//
+//   cc -O2 -DBF_NO_MAIN -I.. -o resume_steps resume_steps.c ../brainfuck.c
+//   ./resume_steps
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "brainfuck.h"
+
+// Between them these end loops with a plain JNZ, with a move then JNZ and
+// with an add, a move then JNZ, which the engine runs as superinstructions.
+// Each starts by reading, which keeps compile-time evaluation of the
+// program's prefix from running it all before the engine gets to.
+static const char* const programs[] = {
+    ",[-]++++++++[>++++[>++>+++>+++>+<<<<-]>+>+>->>+[<]<-]>>.>---.+++++++..+++.>>.<-.<.+++.------.--------.>>+.",
+    ",[-]>+++++[>+++++<-]>[>++<-]>[<+>>+<-]+++[>.<-]",
+    ",[-]++++[>++++<-]>[>+>++>+++<<<-]>>>[-<<+>>]<[<<+>>>+<-]<<[>.<-]",
+    ",[>,]<[.<]",
+};
+
+static const size_t slices[] = { 1, 2, 3, 7, 10, 100, 1000 };
+
+typedef struct {
+    unsigned char data[4096];
+    size_t len;
+} Buffer;
+
+static void write_out(void* ctx, const unsigned char* data, size_t n) {
+    Buffer* b = ctx;
+    if (n > sizeof(b->data) - b->len) n = sizeof(b->data) - b->len;
+    memcpy(b->data + b->len, data, n);
+    b->len += n;
+}
+
+static size_t read_in(void* ctx, unsigned char* buf, size_t n) {
+    const char** in = ctx;
+    size_t len = strlen(*in);
+    if (n > len) n = len;
+    memcpy(buf, *in, n);
+    *in += n;
+    return n;
+}
+
+// Runs prog to the end in slices of `steps` back-edges.
+static uint64_t run(const bf_program* prog, uint64_t steps, Buffer* out) {
+    const char* input = "resumable";
+    out->len = 0;
+    bf_state* st = bf_start(prog, read_in, &input, write_out, out);
+    if (!st) {
+        fprintf(stderr, "bf_start failed\n");
+        exit(1);
+    }
+    while (bf_resume(st, steps, 0) == BF_PAUSED)
+        ;
+    uint64_t taken = bf_steps(st);
+    bf_state_free(st);
+    return taken;
+}
+
+int main(void) {
+    int failed = 0;
+    for (size_t p = 0; p < sizeof(programs) / sizeof(programs[0]); p++) {
+        char err[64];
+        bf_program* prog = bf_compile(programs[p], strlen(programs[p]), NULL, err, sizeof(err));
+        if (!prog) {
+            fprintf(stderr, "program %zu: %s\n", p, err);
+            return 1;
+        }
+        Buffer whole, sliced;
+        uint64_t expect = run(prog, 0, &whole);
+        for (size_t s = 0; s < sizeof(slices) / sizeof(slices[0]); s++) {
+            uint64_t got = run(prog, slices[s], &sliced);
+            if (got != expect) {
+                fprintf(stderr, "program %zu, slices of %zu: %llu back-edges, expected %llu\n", p, slices[s],
+                        (unsigned long long)got, (unsigned long long)expect);
+                failed = 1;
+            }
+            if (sliced.len != whole.len || memcmp(sliced.data, whole.data, whole.len) != 0) {
+                fprintf(stderr, "program %zu, slices of %zu: output differs\n", p, slices[s]);
+                failed = 1;
+            }
+        }
+        bf_free(prog);
+    }
+    if (!failed) printf("ok\n");
+    return failed;
+}